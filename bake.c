@@ -0,0 +1,389 @@
+/* bake.c - pack the images of lambhorn into a texture atlas
+ * Copyright (c) 2020 Tofu Taco Co-op
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ * .
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ * .
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include "SDL.h"
+#include "SDL_image.h"
+#include "pack.h"
+
+/* The usage message of the program */
+#define USAGE \
+        "usage: bake [-o ATLAS.png] [-p ATLAS.pak] -H ATLAS.h " \
+        "[-f NAME=FONT.png]... [-s NAME=SPRITE.png]...\n"
+
+/* The most images that can be packed into one atlas */
+#define MAX_IMAGES 256
+/* The most glyphs that can be found in one font */
+#define MAX_GLYPHS 256
+
+/* Images are the fonts and sprites to be packed. */
+struct image {
+        const char *name;
+        const char *path;
+        int is_font;
+        SDL_Surface *surf;
+        SDL_Rect rect;                  /* where the image is in the atlas */
+        SDL_Rect clips[MAX_GLYPHS];     /* glyph clips, relative to rect */
+        int num_clips;
+};
+
+static struct image _images[MAX_IMAGES];
+static int _num_images = 0;
+
+/* Abort the program with an error message. */
+void die(const char *format, ...) {
+        va_list ap;
+
+        va_start(ap, format);
+        vfprintf(stderr, format, ap);
+        va_end(ap);
+
+        exit(EXIT_FAILURE);
+}
+
+/* Add an image from a NAME=PATH argument. */
+static void _add_image(char *arg, int is_font) {
+        struct image *image;
+        char *equals = strchr(arg, '=');
+
+        if (!equals || equals == arg) {
+                die(USAGE);
+        }
+        if (_num_images == MAX_IMAGES) {
+                die("bake: too many images\n");
+        }
+
+        *equals = '\0';
+        image = &_images[_num_images++];
+        image->name = arg;
+        image->path = equals + 1;
+        image->is_font = is_font;
+}
+
+/* Load an image as tightly packed RGB, like the game uploads it. */
+static void _load_image(struct image *image) {
+        SDL_Surface *surf;
+
+        surf = IMG_Load(image->path);
+        if (!surf) {
+                die("IMG_Load: %s\n", IMG_GetError());
+        }
+
+        image->surf = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
+        SDL_FreeSurface(surf);
+        if (!image->surf) {
+                die("SDL_ConvertSurfaceFormat: %s\n", SDL_GetError());
+        }
+
+        image->rect.w = image->surf->w;
+        image->rect.h = image->surf->h;
+}
+
+/* Find the glyph clips of a font.  The bottom row of a font image marks
+ * the gaps between glyphs with the color of its first pixel. */
+static void _find_font_clips(struct image *image) {
+        SDL_Surface *surf = image->surf;
+        const Uint8 *row;
+        int x = 1;
+        int j;
+
+        SDL_LockSurface(surf);
+        row = (const Uint8 *)surf->pixels + surf->pitch * (surf->h - 1);
+
+        for (j = x; j < surf->w; j++) {
+                if (memcmp(&row[j * 3], &row[0], 3) == 0) {
+                        SDL_Rect *clip;
+
+                        if (image->num_clips == MAX_GLYPHS) {
+                                die("bake: %s: too many glyphs\n", image->path);
+                        }
+
+                        clip = &image->clips[image->num_clips++];
+                        clip->x = x;
+                        clip->y = 0;
+                        clip->w = j - x;
+                        clip->h = surf->h - 1;
+                        x = j + 1;
+                }
+        }
+
+        SDL_UnlockSurface(surf);
+}
+
+/* Round a size up to a power of two. */
+static int _power_of_two(int size) {
+        int p = 1;
+
+        while (p < size) {
+                p *= 2;
+        }
+
+        return p;
+}
+
+/* Sort images from tallest to shortest. */
+static int _compare_heights(const void *a, const void *b) {
+        const struct image *const *x = a;
+        const struct image *const *y = b;
+
+        return (*y)->rect.h - (*x)->rect.h;
+}
+
+/* Pack the images into rows of an atlas and return the atlas size. */
+static void _pack_images(int *width, int *height) {
+        struct image *order[MAX_IMAGES];
+        int x = 0;
+        int y = 0;
+        int row_height = 0;
+        int i;
+
+        *width = 1;
+        for (i = 0; i < _num_images; i++) {
+                order[i] = &_images[i];
+                if (_images[i].rect.w > *width) {
+                        *width = _images[i].rect.w;
+                }
+        }
+        *width = _power_of_two(*width);
+
+        qsort(order, (size_t)_num_images, sizeof *order, &_compare_heights);
+
+        for (i = 0; i < _num_images; i++) {
+                struct image *image = order[i];
+
+                if (x + image->rect.w > *width) {
+                        x = 0;
+                        y += row_height;
+                        row_height = 0;
+                }
+
+                image->rect.x = x;
+                image->rect.y = y;
+                x += image->rect.w;
+                if (image->rect.h > row_height) {
+                        row_height = image->rect.h;
+                }
+        }
+
+        *height = _power_of_two(y + row_height);
+}
+
+/* Draw every image into a new atlas surface. */
+static SDL_Surface *_build_atlas(int width, int height) {
+        SDL_Surface *atlas;
+        int i;
+
+        atlas = SDL_CreateRGBSurfaceWithFormat(0, width, height, 24,
+                                               SDL_PIXELFORMAT_RGB24);
+        if (!atlas) {
+                die("SDL_CreateRGBSurfaceWithFormat: %s\n", SDL_GetError());
+        }
+        SDL_FillRect(atlas, NULL, 0xffffff);
+
+        for (i = 0; i < _num_images; i++) {
+                SDL_Rect rect = _images[i].rect;
+
+                SDL_SetSurfaceBlendMode(_images[i].surf, SDL_BLENDMODE_NONE);
+                if (SDL_BlitSurface(_images[i].surf, NULL, atlas, &rect) != 0) {
+                        die("SDL_BlitSurface: %s\n", SDL_GetError());
+                }
+        }
+
+        return atlas;
+}
+
+/* Write bytes to a file or die trying. */
+static void _write_bytes(FILE *out, const char *path, const void *bytes, size_t size) {
+        if (size > 0 && fwrite(bytes, size, 1, out) != 1) {
+                die("bake: cannot write %s\n", path);
+        }
+}
+
+/* Write the atlas as a pack holding its pixels ready for upload. */
+static void _write_pack(const char *path, SDL_Surface *atlas) {
+        static const char padding[PACK_ALIGNMENT] = {0};
+        struct pack_header header;
+        struct pack_entry entry;
+        size_t row_size = (size_t)atlas->w * 3;
+        size_t table_end = sizeof header + sizeof entry;
+        size_t offset = (table_end + PACK_ALIGNMENT - 1)
+                        / PACK_ALIGNMENT * PACK_ALIGNMENT;
+        FILE *out;
+        int y;
+
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, PACK_MAGIC, sizeof PACK_MAGIC);
+        header.version = PACK_VERSION;
+        header.num_entries = 1;
+
+        memset(&entry, 0, sizeof entry);
+        strcpy(entry.name, "atlas");
+        entry.format = PACK_FORMAT_RGB8;
+        entry.width = (Uint32)atlas->w;
+        entry.height = (Uint32)atlas->h;
+        entry.offset = (Uint32)offset;
+        entry.size = (Uint32)(row_size * (size_t)atlas->h);
+
+        out = fopen(path, "wb");
+        if (!out) {
+                die("bake: cannot write %s\n", path);
+        }
+
+        _write_bytes(out, path, &header, sizeof header);
+        _write_bytes(out, path, &entry, sizeof entry);
+        _write_bytes(out, path, padding, offset - table_end);
+
+        /* Drop the row padding of the surface. */
+        SDL_LockSurface(atlas);
+        for (y = 0; y < atlas->h; y++) {
+                _write_bytes(out, path,
+                             (const Uint8 *)atlas->pixels + atlas->pitch * y,
+                             row_size);
+        }
+        SDL_UnlockSurface(atlas);
+
+        if (fclose(out) != 0) {
+                die("bake: cannot write %s\n", path);
+        }
+}
+
+/* Write an image name in upper case. */
+static void _write_name(FILE *out, const char *name) {
+        for (; *name != '\0'; name++) {
+                fputc(isalnum((unsigned char)*name)
+                        ? toupper((unsigned char)*name)
+                        : '_',
+                      out);
+        }
+}
+
+/* Write the header describing where everything is in the atlas. */
+static void _write_header(const char *path, int width, int height) {
+        FILE *out;
+        int i;
+
+        out = fopen(path, "w");
+        if (!out) {
+                die("bake: cannot write %s\n", path);
+        }
+
+        fprintf(out, "/* %s - generated by bake; do not edit. */\n", path);
+        fprintf(out, "#define ATLAS_WIDTH %d\n", width);
+        fprintf(out, "#define ATLAS_HEIGHT %d\n", height);
+
+        for (i = 0; i < _num_images; i++) {
+                struct image *image = &_images[i];
+                int j;
+
+                fprintf(out, "\n/* %s */\n", image->path);
+                fprintf(out, "#define ATLAS_");
+                _write_name(out, image->name);
+                fprintf(out, " {%d, %d, %d, %d}\n",
+                        image->rect.x, image->rect.y,
+                        image->rect.w, image->rect.h);
+
+                if (!image->is_font) {
+                        continue;
+                }
+
+                fprintf(out, "#define ATLAS_");
+                _write_name(out, image->name);
+                fprintf(out, "_NUM_CLIPS %d\n", image->num_clips);
+                fprintf(out, "#define FOR_ATLAS_");
+                _write_name(out, image->name);
+                fprintf(out, "_CLIP(X)");
+                for (j = 0; j < image->num_clips; j++) {
+                        SDL_Rect *clip = &image->clips[j];
+
+                        fprintf(out, " \\\n        X(%d, %d, %d, %d)",
+                                image->rect.x + clip->x,
+                                image->rect.y + clip->y,
+                                clip->w,
+                                clip->h);
+                }
+                fprintf(out, "\n");
+        }
+
+        if (fclose(out) != 0) {
+                die("bake: cannot write %s\n", path);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        const char *atlas_path = NULL;
+        const char *pack_path = NULL;
+        const char *header_path = NULL;
+        SDL_Surface *atlas;
+        int width;
+        int height;
+        int i;
+
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                        atlas_path = argv[++i];
+                } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+                        pack_path = argv[++i];
+                } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+                        header_path = argv[++i];
+                } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+                        _add_image(argv[++i], 1);
+                } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+                        _add_image(argv[++i], 0);
+                } else {
+                        die(USAGE);
+                }
+        }
+
+        if ((!atlas_path && !pack_path) || !header_path || _num_images == 0) {
+                die(USAGE);
+        }
+
+        if ((IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG) != IMG_INIT_PNG) {
+                die("IMG_Init: %s\n", IMG_GetError());
+        }
+        atexit(&IMG_Quit);
+
+        for (i = 0; i < _num_images; i++) {
+                _load_image(&_images[i]);
+                if (_images[i].is_font) {
+                        _find_font_clips(&_images[i]);
+                }
+        }
+
+        _pack_images(&width, &height);
+        atlas = _build_atlas(width, height);
+        if (atlas_path && IMG_SavePNG(atlas, atlas_path) != 0) {
+                die("IMG_SavePNG: %s\n", IMG_GetError());
+        }
+        if (pack_path) {
+                _write_pack(pack_path, atlas);
+        }
+        _write_header(header_path, width, height);
+        SDL_FreeSurface(atlas);
+
+        for (i = 0; i < _num_images; i++) {
+                SDL_FreeSurface(_images[i].surf);
+        }
+
+        return 0;
+}
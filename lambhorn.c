@@ -17,13 +17,30 @@
  *    misrepresented as being the original software.
  * 3. This notice may not be removed or altered from any source distribution.
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef LAMBHORN_DEVELOPMENT
+#include <sys/inotify.h>
+#endif
 #include "SDL.h"
 #include "SDL_image.h"
 #include <GL/gl.h>
 #include <GL/glu.h>
+#include <GL/glext.h>
+#include "atlas.h"
+#include "pack.h"
+#include "save.h"
 
 /* Mark a variable as being used. */
 #define USED(x) ((void)(x))
@@ -34,15 +51,82 @@
 #define WINDOW_WIDTH 640
 /* The height of the game window in pixels */
 #define WINDOW_HEIGHT 480
+/* The number of simulation ticks per second */
+#define TICKS_PER_SECOND 50
+/* The most ticks simulated before a frame, so that a stall cannot
+ * snowball into ever longer catch-ups */
+#define MAX_TICKS_PER_FRAME 5
+/* The most frames drawn per second unless told otherwise */
+#define DEFAULT_FPS_CAP 60
+/* The longest time to sleep while waiting for input, in milliseconds */
+#define IDLE_TIMEOUT 1000
+/* The number of input events that can wait for the simulation thread */
+#define INPUT_QUEUE_SIZE 256
+/* The number of tile changes that can wait for the render thread */
+#define TILE_EDIT_QUEUE_SIZE 1024
+/* The size the frame arena starts out at, in bytes */
+#define FRAME_ARENA_SIZE (64 * 1024)
+/* The alignment of everything handed out by arenas */
+#define ARENA_ALIGNMENT 16
+/* The width of the box that menu descriptions wrap in, in pixels */
+#define DESCRIPTION_WIDTH (WINDOW_WIDTH - 100 - 9)
+/* The most lines of a menu description shown */
+#define DESCRIPTION_MAX_LINES 3
+/* The width and height of a tile in pixels */
+#define TILE_SIZE 8
+/* The width and height of a tilemap chunk in tiles */
+#define CHUNK_SIZE 32
+/* The width and height of the world in tiles */
+#define WORLD_WIDTH 512
+#define WORLD_HEIGHT 512
+/* The number of tiles that the camera moves per key press */
+#define CAMERA_STEP 4
+/* The most entities that can be in the world at once */
+#define MAX_ENTITIES 65536
+/* The number of lambs wandering the world, when there are lambs */
+#define NUM_LAMBS 1024
+/* The fastest lambs wander, in tiles per tick */
+#define LAMB_SPEED 0.05f
+/* The number of ticks lambs wander before they turn */
+#define LAMB_TURN_TICKS 64
+/* Where the game is saved unless told otherwise */
+#define SAVE_PATH "lambhorn.sav"
+/* The number of ticks between saves while playing */
+#define AUTOSAVE_TICKS (TICKS_PER_SECOND * 10)
+/* The frames drawn before timing each benchmark scene, so that caches
+ * are warm */
+#define BENCH_WARMUP_FRAMES 10
+/* The number of lambs in the entity benchmark */
+#define BENCH_ENTITIES 50000
+
+/* The usage message of the game */
+#define USAGE \
+        "usage: lambhorn [--continuous] [--frame-stats] [--vsync] [--fps-cap N] " \
+        "[--bench N] [--trace FILE]\n" \
+        "                [--record FILE] [--replay FILE [--repeat N] [--no-present]]\n" \
+        "                [--renderer core|legacy] [--scale N] [--fullscreen]\n" \
+        "                [--save FILE] [--continue] [--lambs]\n"
+
+/* Glyphs are the metrics of one character, ready for drawing */
+struct glyph {
+        GLfloat s0, t0;         /* texture coordinates of the top-left */
+        GLfloat s1, t1;         /* texture coordinates of the bottom-right */
+        GLfloat width;          /* width of the glyph in pixels */
+        GLfloat height;         /* height of the glyph in pixels */
+        GLfloat advance;        /* distance from this glyph to the next */
+};
 
 /* Fonts contain the data needed for drawing text */
 struct font {
         const char *alphabet;
         GLuint texture;
         SDL_Rect *clips;
+        struct glyph *glyphs;
+        struct glyph *glyph_map[256];   /* glyphs indexed by character */
         int image_width;
         int image_height;
         int height;
+        unsigned generation;            /* bumped whenever glyphs change */
 };
 
 /* Sprites are combine textures with width and height information. */
@@ -50,8 +134,484 @@ struct sprite {
         GLuint texture;
         int width;
         int height;
+        GLfloat s0, t0;         /* texture coordinates of the top-left */
+        GLfloat s1, t1;         /* texture coordinates of the bottom-right */
+};
+
+/* Quads are textured rectangles in window coordinates. */
+struct quad {
+        GLfloat x0, y0;         /* top-left corner */
+        GLfloat x1, y1;         /* bottom-right corner */
+        GLfloat s0, t0;         /* texture coordinates of the top-left */
+        GLfloat s1, t1;         /* texture coordinates of the bottom-right */
+};
+
+/* Renderers are the ways of drawing quads with a certain kind of GL
+ * context. */
+struct renderer {
+        const char *name;
+        int core_profile;               /* whether it needs a 3.3 core context */
+        int (*init)(void);
+        void (*quit)(void);
+        void (*draw_quads)(const struct quad *quads, int num_quads);
+        void (*upload_mesh)(GLuint buffer, const struct quad *quads, int num_quads);
+        void (*draw_mesh)(GLuint buffer, int num_quads, GLfloat x, GLfloat y);
+};
+
+/* The layers of the screen, drawn from the bottom up.  Draws in the same
+ * layer are sorted by texture, so only draws of the same texture keep
+ * their order where they overlap. */
+enum render_layer {
+        RENDER_LAYER_WORLD,
+        RENDER_LAYER_ENTITIES,
+        RENDER_LAYER_MENU,
+        RENDER_LAYER_OVERLAY
+};
+
+/* Render commands are draws waiting in the render queue for the end of
+ * the frame.  They are sorted by key, which orders them by layer, then
+ * texture, then meshes before loose quads, then the order they came in. */
+struct render_command {
+        Uint64 key;
+        GLuint texture;
+        GLuint buffer;                  /* the mesh buffer, or 0 for quads */
+        int first;                      /* the first of the queued quads */
+        int num_quads;
+        GLfloat x, y;                   /* where the mesh is moved to */
+};
+
+/* Text batches collect the glyphs of many strings in one font so that
+ * they can all be drawn at once. */
+struct text_batch {
+        struct font *font;
+        struct quad *quads;
+        int num_quads;
+        int max_quads;
+};
+
+/* Menus are a prompt and a list of options to choose from. */
+struct menu {
+        const char *prompt;
+        int num_options;
+        const char **options;
+        const char **descriptions;
+        const char *text;               /* the prompt and options as one string */
+};
+
+/* The modes that the game can be in */
+enum game_mode {
+        GAME_MODE_MENU,
+        GAME_MODE_PLAY
+};
+
+/* The kinds of tiles, in the order they appear in the tiles image */
+enum {
+        TILE_BLANK,
+        TILE_GRASS,
+        TILE_TALL_GRASS,
+        TILE_WATER,
+        TILE_TREE,
+        TILE_ROCK,
+        TILE_WALL,
+        TILE_PATH,
+        NUM_TILES
+};
+
+/* Chunks are square blocks of a tilemap, each drawn from its own mesh. */
+struct chunk {
+        Uint8 tiles[CHUNK_SIZE][CHUNK_SIZE];    /* by row, then column */
+        GLuint buffer;                          /* the mesh of the tiles */
+        int num_quads;
+        int dirty;                              /* whether the mesh is stale */
+        unsigned tiles_generation;              /* of the tiles it was built with */
+};
+
+/* Tilemaps are grids of tiles stored in chunks. */
+struct tilemap {
+        int width;                      /* in tiles */
+        int height;                     /* in tiles */
+        int chunks_wide;
+        int chunks_high;
+        struct chunk *chunks;
+        unsigned edits;                 /* bumped whenever a tile changes */
+};
+
+/* The components of entities, each kept in an array of its own */
+#define FOR_ENTITY_COMPONENT(X) \
+        X(GLfloat, x)           /* the top-left, in tiles */ \
+        X(GLfloat, y) \
+        X(GLfloat, previous_x)  /* where it was one tick ago */ \
+        X(GLfloat, previous_y) \
+        X(GLfloat, velocity_x)  /* in tiles per tick */ \
+        X(GLfloat, velocity_y) \
+        X(Uint8, sprite) \
+        X(Sint16, health) \
+        X(Sint16, might) \
+        X(Sint16, agility) \
+        X(Sint16, wits) \
+        X(Uint16, slot)         /* the slot of the handle */
+
+/* The sprites that entities are drawn with */
+enum {
+        ENTITY_SPRITE_PLAYER,
+        ENTITY_SPRITE_LAMB,
+        NUM_ENTITY_SPRITES
+};
+
+/* Stats are how hardy, strong, quick and clever an entity is. */
+struct stats {
+        Sint16 health;
+        Sint16 might;
+        Sint16 agility;
+        Sint16 wits;
+};
+
+/* Entity stores keep the components of their entities packed at the
+ * front of their arrays, so that passes over them stream through memory.
+ * Handles stay the same while entities move around the arrays: the low
+ * 16 bits are a slot holding the index of the entity, and the high 16
+ * bits are the generation of the slot, bumped when its entity goes. */
+struct entities {
+        int count;
+#define OP(type, name) type *name;
+        FOR_ENTITY_COMPONENT(OP)
+#undef OP
+        Uint16 *index;                  /* the entity index of each slot */
+        Uint16 *generation;             /* the generation of each slot */
+        Uint16 *free_slots;
+        int num_free_slots;
+        int num_slots;                  /* one past the highest slot ever
+                                         * handed out */
+};
+
+/* The handle of no entity */
+#define ENTITY_NONE 0
+
+/* Queues pass items from one thread to another without locking.  Only
+ * one thread may push onto a queue, and only one may pop from it. */
+struct queue {
+        char *items;
+        size_t item_size;
+        unsigned capacity;              /* a power of two */
+        SDL_atomic_t head;              /* the number of items popped */
+        SDL_atomic_t tail;              /* the number of items pushed */
+};
+
+/* Arena blocks are memory borrowed from the heap by an arena that ran
+ * out, followed by the memory handed out. */
+struct arena_block {
+        struct arena_block *next;
+};
+
+/* Arenas hand out memory that is all given back at once.  An arena that
+ * runs out borrows blocks from the heap until it is reset, and then grows
+ * to fit everything it was asked for, so that once it has seen its
+ * busiest frame it stops touching the heap. */
+struct arena {
+        char *base;
+        size_t size;
+        size_t used;                    /* of the base, in bytes */
+        size_t borrowed;                /* in borrowed blocks, in bytes */
+        struct arena_block *blocks;
+        unsigned long allocations;      /* since the last reset */
+        size_t peak;                    /* the most bytes used between resets */
+        size_t last_used;               /* the bytes used before the last reset */
+        unsigned long last_allocations;
+};
+
+/* Pools hand out fixed-size items from one block, for objects that
+ * outlive a frame but come and go too often to go to the heap. */
+struct pool {
+        char *items;
+        size_t item_size;
+        int capacity;
+        void *free_items;               /* a list threaded through the free items */
+        int num_used;
+        int peak;                       /* the most items used at once */
+};
+
+/* Tile edits are changes to the world, passed from the simulation to
+ * the copy of the world that is drawn. */
+struct tile_edit {
+        Uint16 x;
+        Uint16 y;
+        Uint8 tile;
+};
+
+/* Games are the state that input changes and ticks advance. */
+struct game {
+        const struct menu *menu;
+        int selection;
+        enum game_mode mode;
+        GLfloat cursor_row;             /* the selection as of the last tick */
+        GLfloat previous_cursor_row;    /* where the cursor was one tick ago */
+        Uint32 tick;                    /* the number of ticks so far */
+        int quit;
+        struct tilemap *world;
+        int camera_x;                   /* the top-left tile in view */
+        int camera_y;
+        int heritage;                   /* the options chosen in the menus */
+        int tradition;
+        struct entities *entities;
+        Uint32 player;                  /* the handle of the player */
+        struct queue *tile_edits;       /* where to pass tile changes, if anywhere */
+        Uint32 unsaved;                 /* the bit of each kind of save
+                                         * section that is out of date */
+};
+
+/* The components of entities that drawing them needs */
+#define FOR_DRAWN_ENTITY_COMPONENT(X) \
+        X(GLfloat, x) \
+        X(GLfloat, y) \
+        X(GLfloat, previous_x) \
+        X(GLfloat, previous_y) \
+        X(Uint8, sprite)
+
+/* Snapshots are the state of the game that the simulation thread hands
+ * to the render thread.  Once handed over, a snapshot does not change
+ * until the render thread hands it back. */
+struct snapshot {
+        const struct menu *menu;
+        int selection;
+        enum game_mode mode;
+        GLfloat cursor_row;
+        GLfloat previous_cursor_row;
+        int camera_x;
+        int camera_y;
+        int quit;
+        int moving;                     /* whether anything in view is moving */
+        Uint64 time;                    /* when the last tick was due */
+        Uint64 logic_start;             /* when the simulation began and */
+        Uint64 logic_end;               /* finished making the snapshot */
+        struct entities entities;       /* only the drawn components */
+};
+
+/* Input records are the events of a recording, stamped with the tick they
+ * were handled before. */
+struct input_record {
+        Uint32 tick;
+        Uint16 type;
+        Uint16 scancode;
+};
+
+/* The sections of a save, in the order they are written */
+#define FOR_SAVE_SECTION(X) \
+        X(CHARACTER, character) \
+        X(GAME, game) \
+        X(WORLD, world) \
+        X(ENTITIES, entities)
+
+enum {
+#define OP(id, name) SAVE_INDEX_##id,
+        FOR_SAVE_SECTION(OP)
+#undef OP
+        NUM_SAVE_SECTIONS
+};
+
+/* Save writers write the parts of a section one after another, or only
+ * add up their size if they have no file. */
+struct save_writer {
+        int fd;                         /* or -1 to only measure */
+        Uint32 offset;                  /* where the next part goes */
+        Uint32 size;                    /* of the section so far */
+        Uint32 checksum;
+        int failed;
+};
+
+/* Save finishes are the syncing and switching over of a save that has
+ * been written, which a thread of its own waits for the disk to do. */
+struct save_finish {
+        int fd;
+        int whole;                      /* whether the save is a new file */
+        struct save_section table[NUM_SAVE_SECTIONS];   /* to switch to, if
+                                                         * not whole */
+        char temp_path[1024];           /* of the new file, if whole */
+        const char *path;
+};
+
+/* Asset packs hold pre-decoded images mapped straight into memory. */
+struct pack {
+        const Uint8 *data;
+        size_t size;
+        const struct pack_header *header;
+        const struct pack_entry *entries;
+};
+
+/* Asset jobs decode an image off the main thread, then upload it to a
+ * texture a few rows at a time on the main thread. */
+struct asset_job {
+        const char *path;               /* the image, or NULL for pixels */
+        GLuint *texture;                /* set once the upload finishes */
+        void (*surface_handler)(SDL_Surface*, void*);
+        void *data;
+        SDL_Surface *surf;              /* the decoded image */
+        SDL_Surface *converted;         /* the image converted to RGB */
+        const Uint8 *pixels;
+        int width;
+        int height;
+        int pitch;
+        GLuint pending_texture;         /* the texture being uploaded */
+        int uploaded_rows;
+        char error[256];
+        int reload;                     /* whether the texture replaces one
+                                         * that is in use */
+        struct asset_job *next;
 };
 
+/* Loose images are the images that development builds load one by one
+ * instead of from the asset pack, and load again whenever they change. */
+struct loose_image {
+        const char *path;
+        GLuint *texture;
+        void (*surface_handler)(SDL_Surface*, void*);
+        void *data;
+        int loading;                    /* whether a load is under way */
+        int changed;                    /* whether it changed while loading */
+};
+
+/* Profile events are the start and end of one timed section of a frame,
+ * in performance counter units. */
+struct profile_event {
+        int section;
+        int thread;
+        Uint64 start;
+        Uint64 end;
+};
+
+/* The most threads decoding images at once */
+#define MAX_ASSET_WORKERS 4
+/* The most images that can be loading at once */
+#define MAX_ASSET_JOBS 64
+/* The most bytes of pixels uploaded to textures per frame */
+#define ASSET_UPLOAD_BUDGET (256 * 1024)
+/* The longest time in ms between checks for changed images, in
+ * development builds */
+#define IMAGE_WATCH_INTERVAL 250
+
+/* How the lines of text sit in their box */
+enum {
+        TEXT_ALIGN_LEFT,
+        TEXT_ALIGN_CENTER,
+        TEXT_ALIGN_RIGHT
+};
+
+/* Text lines are the part of a string that fits on one line of a box. */
+struct text_line {
+        int start;                      /* the offset of the first character */
+        int length;
+        int width;                      /* in pixels */
+        int ellipsis;                   /* whether "..." follows the line */
+};
+
+/* Text layouts are strings wrapped once to fit a box of a certain width. */
+struct text_layout {
+        struct font *font;
+        unsigned font_generation;
+        int width;                      /* of the box, or 0 to not wrap */
+        int align;
+        int max_lines;                  /* or 0 for no limit */
+        unsigned long hash;
+        char *text;
+        int text_capacity;              /* kept when the slot is reused */
+        struct text_line *lines;
+        int num_lines;
+        int lines_capacity;
+        unsigned long last_used;
+};
+
+/* The number of text layouts kept in the cache */
+#define TEXT_LAYOUT_CACHE_SIZE 64
+/* The number of cache slots searched for a text layout */
+#define TEXT_LAYOUT_CACHE_PROBES 8
+
+/* Text meshes are strings laid out once and kept in a GPU buffer. */
+struct text_mesh {
+        struct font *font;
+        unsigned font_generation;
+        int x;
+        int y;
+        int width;                      /* of the box, or 0 to not wrap */
+        int align;
+        int max_lines;
+        unsigned long hash;
+        char *text;
+        int text_capacity;              /* kept when the slot is reused */
+        GLuint buffer;
+        int num_quads;
+        unsigned long last_used;
+};
+
+/* The number of text meshes kept in the cache */
+#define TEXT_MESH_CACHE_SIZE 64
+/* The number of cache slots searched for a text mesh */
+#define TEXT_MESH_CACHE_PROBES 8
+
+/* The OpenGL functions that are loaded at run-time */
+#define FOR_GL_PROC(X) \
+        X(PFNGLGENBUFFERSPROC, glGenBuffers) \
+        X(PFNGLDELETEBUFFERSPROC, glDeleteBuffers) \
+        X(PFNGLBINDBUFFERPROC, glBindBuffer) \
+        X(PFNGLBUFFERDATAPROC, glBufferData)
+
+/* The OpenGL 3.3 functions used by the core renderer */
+#define FOR_CORE_GL_PROC(X) \
+        X(PFNGLCREATESHADERPROC, glCreateShader) \
+        X(PFNGLSHADERSOURCEPROC, glShaderSource) \
+        X(PFNGLCOMPILESHADERPROC, glCompileShader) \
+        X(PFNGLGETSHADERIVPROC, glGetShaderiv) \
+        X(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog) \
+        X(PFNGLDELETESHADERPROC, glDeleteShader) \
+        X(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
+        X(PFNGLATTACHSHADERPROC, glAttachShader) \
+        X(PFNGLLINKPROGRAMPROC, glLinkProgram) \
+        X(PFNGLGETPROGRAMIVPROC, glGetProgramiv) \
+        X(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog) \
+        X(PFNGLDELETEPROGRAMPROC, glDeleteProgram) \
+        X(PFNGLUSEPROGRAMPROC, glUseProgram) \
+        X(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation) \
+        X(PFNGLUNIFORM1IPROC, glUniform1i) \
+        X(PFNGLUNIFORM2FPROC, glUniform2f) \
+        X(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays) \
+        X(PFNGLDELETEVERTEXARRAYSPROC, glDeleteVertexArrays) \
+        X(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray) \
+        X(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray) \
+        X(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer) \
+        X(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor) \
+        X(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced) \
+        X(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange) \
+        X(PFNGLUNMAPBUFFERPROC, glUnmapBuffer) \
+        X(PFNGLFENCESYNCPROC, glFenceSync) \
+        X(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync) \
+        X(PFNGLDELETESYNCPROC, glDeleteSync)
+
+/* The OpenGL functions that are used when available */
+#define FOR_OPTIONAL_GL_PROC(X) \
+        X(PFNGLBUFFERSTORAGEPROC, glBufferStorage)
+
+/* The OpenGL 3.0 functions used to draw the scene offscreen, when
+ * available */
+#define FOR_FRAMEBUFFER_GL_PROC(X) \
+        X(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers) \
+        X(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers) \
+        X(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer) \
+        X(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D) \
+        X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus) \
+        X(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer)
+
+#define OP(type, name) static type _##name = NULL;
+FOR_GL_PROC(OP)
+FOR_CORE_GL_PROC(OP)
+FOR_OPTIONAL_GL_PROC(OP)
+FOR_FRAMEBUFFER_GL_PROC(OP)
+#undef OP
+
+/* The size of the ring buffer that the core renderer streams quads
+ * through, in bytes */
+#define RING_SIZE (1024 * 1024)
+/* The number of parts of the ring buffer, each fenced once it is full so
+ * that it is not written again while the GPU may still read it */
+#define RING_SEGMENTS 4
+
 /* The clips for each letter in the font (computed at run-time) */
 #define FOR_GLYPH(X) \
         X("A")  X("B")  X("C")  X("D") \
@@ -76,6 +636,8 @@ static SDL_Rect _font_clips[] = {
 #undef OP
 };
 
+static struct glyph _font_glyphs[sizeof _font_clips / sizeof *_font_clips];
+
 /* The main game font */
 static struct font _font = {
 #define OP(glyph) glyph
@@ -83,13 +645,261 @@ static struct font _font = {
 #undef OP
         0,                      /* texture (loaded at run-time) */
         _font_clips,            /* clips (filled at run-time) */
+        _font_glyphs,           /* glyphs (computed at run-time) */
+        {NULL},                 /* glyph_map (computed at run-time) */
         0,                      /* image_width (loaded at run-time) */
         0,                      /* image_height (loaded at run-time) */
-        0                       /* height (computed at run-time) */
+        0,                      /* height (computed at run-time) */
+        0                       /* generation (bumped at run-time) */
 };
 
+/* The tiles texture, a row of tiles */
+static struct sprite _tiles_sprite = {0, 0, 0, 0.0f, 0.0f, 0.0f, 0.0f}; /* loaded at run-time */
+/* Bumped whenever the tiles image is loaded again, so that every chunk
+ * mesh of every tilemap is built again */
+static unsigned _tiles_generation = 0;
+
+/* The world being played in */
+static struct tilemap _world = {0, 0, 0, 0, NULL, 0};
+
 /* The cursor texture */
-static struct sprite _cursor_sprite = {0, 0, 0}; /* loaded at run-time */
+static struct sprite _cursor_sprite = {0, 0, 0, 0.0f, 0.0f, 0.0f, 0.0f}; /* loaded at run-time */
+
+/* The lamb texture */
+static struct sprite _lamb_sprite = {0, 0, 0, 0.0f, 0.0f, 0.0f, 0.0f}; /* loaded at run-time */
+
+/* The sprite of each kind of entity */
+static const struct sprite *const _entity_sprites[NUM_ENTITY_SPRITES] = {
+        &_cursor_sprite,
+        &_lamb_sprite
+};
+
+/* The entities of the world */
+static struct entities _entities;
+
+/* The asset pack (mapped at run-time) */
+static struct pack _pack = {NULL, 0, NULL, NULL};
+
+#ifndef LAMBHORN_DEVELOPMENT
+/* The atlas texture (uploaded at run-time) */
+static GLuint _atlas_texture = 0;
+#endif
+
+/* The threads decoding images */
+static SDL_Thread *_asset_workers[MAX_ASSET_WORKERS];
+static int _num_asset_workers = 0;
+/* The jobs waiting for a worker, guarded by a lock and counted by a
+ * semaphore */
+static SDL_mutex *_asset_lock = NULL;
+static SDL_sem *_asset_requested = NULL;
+static struct asset_job *_asset_requests = NULL;
+static struct asset_job **_asset_requests_tail = &_asset_requests;
+/* The lock-free stack of decoded jobs, pushed by the workers */
+static void *_asset_ready = NULL;
+/* The decoded jobs waiting for upload, in order (main thread only) */
+static struct asset_job *_asset_uploads = NULL;
+/* The jobs not yet uploaded (main thread only) */
+static int _num_asset_jobs = 0;
+/* The memory of the jobs (main thread only) */
+static struct pool _asset_job_pool;
+
+/* The batch used for drawing text */
+static struct text_batch _text_batch = {NULL, NULL, 0, 0};
+
+/* The cache of text layouts */
+static struct text_layout _text_layouts[TEXT_LAYOUT_CACHE_SIZE];
+/* The clock used to find the least recently used text layout */
+static unsigned long _text_layout_clock = 0;
+/* The number of times that text was wrapped */
+static unsigned long _text_layouts_built = 0;
+
+/* The cache of text meshes */
+static struct text_mesh _text_meshes[TEXT_MESH_CACHE_SIZE];
+/* The clock used to find the least recently used text mesh */
+static unsigned long _text_mesh_clock = 0;
+/* Whether GPU buffers are available for text meshes */
+static int _have_buffers = 0;
+
+/* The renderer in use */
+static const struct renderer *_renderer = NULL;
+/* A texture of one black pixel, for drawing solid rectangles */
+static GLuint _solid_texture = 0;
+
+/* The framebuffer that the scene is drawn into at the size of the game,
+ * and its texture, or 0 to draw straight to the window */
+static GLuint _scene_framebuffer = 0;
+static GLuint _scene_texture = 0;
+/* The size of the window and where the scene is shown in it, in
+ * pixels */
+static int _drawable_width = WINDOW_WIDTH;
+static int _drawable_height = WINDOW_HEIGHT;
+static SDL_Rect _scene_rect = {0, 0, WINDOW_WIDTH, WINDOW_HEIGHT};
+
+/* The render queue of the frame being drawn */
+static struct render_command *_render_commands = NULL;
+static int _num_render_commands = 0;
+static int _max_render_commands = 0;
+/* The quads of the queued draws */
+static struct quad *_render_quads = NULL;
+static int _num_render_quads = 0;
+static int _max_render_quads = 0;
+/* The layer that draws go to */
+static enum render_layer _render_layer = RENDER_LAYER_MENU;
+/* The value of the text mesh clock when the queue was last flushed, so
+ * that meshes still waiting in the queue are not rebuilt */
+static unsigned long _flushed_text_mesh_clock = 0;
+
+/* The shader program of the core renderer */
+static GLuint _quad_program = 0;
+/* Where the core renderer moves what it draws to, and the uniform
+ * holding it */
+static GLfloat _quad_offset_x = 0.0f;
+static GLfloat _quad_offset_y = 0.0f;
+static GLint _quad_offset_location = -1;
+/* The vertex array of the core renderer */
+static GLuint _quad_vertex_array = 0;
+/* The buffer that quads are streamed through, and its persistently
+ * mapped memory if the driver can do that */
+static GLuint _ring_buffer = 0;
+static Uint8 *_ring_data = NULL;
+/* The offset in the ring buffer that the next quads are written at */
+static size_t _ring_head = 0;
+/* The segment of the ring buffer being written */
+static int _ring_segment = 0;
+/* The fence of each segment, set once the segment has been written */
+static GLsync _ring_fences[RING_SEGMENTS];
+
+/* The magic bytes at the start of every input recording */
+#define RECORDING_MAGIC "LAMBREC"
+/* The version of the input recording layout */
+#define RECORDING_VERSION 1
+
+/* The file that input is being recorded to */
+static FILE *_recording = NULL;
+
+/* Where the game is saved, or NULL to not save it */
+static const char *_save_path = SAVE_PATH;
+/* Whether new games fill the world with lambs */
+static int _herding = 0;
+/* The sections of the save as they are on disk, once it has been written
+ * or loaded, so that changed sections can be written in place */
+static struct save_section _save_table[NUM_SAVE_SECTIONS];
+static int _have_save_table = 0;
+/* The thread finishing the last save, and whether it is still at it */
+static SDL_Thread *_save_finisher = NULL;
+static SDL_atomic_t _save_finishing;
+static struct save_finish _save_finish;
+
+/* The simulation thread, and whether it should keep running */
+static SDL_Thread *_simulation = NULL;
+static SDL_atomic_t _simulating;
+
+/* The input waiting for the simulation thread, its wake-up call, and
+ * whether input is being dropped for want of room */
+static struct queue _input_queue;
+static SDL_sem *_input_ready = NULL;
+static int _dropping_input = 0;
+
+/* The changes to the world waiting for the render thread */
+static struct queue _tile_edits;
+
+/* The copy of the world that the render thread draws while the
+ * simulation runs on its own thread */
+static struct tilemap _world_view = {0, 0, 0, 0, NULL, 0};
+
+/* The triple buffer of snapshots.  The simulation thread fills the back
+ * snapshot while the render thread draws the front one, and each trades
+ * its own for the middle one, which is the newest finished snapshot.
+ * SNAPSHOT_FRESH marks the middle one until the render thread takes it. */
+#define SNAPSHOT_FRESH 4
+static struct snapshot _snapshots[3];
+static int _back_snapshot = 0;
+static SDL_atomic_t _middle_snapshot;
+static int _front_snapshot = 2;
+
+/* The event that wakes the render thread for a new snapshot, and
+ * whether one is already on its way */
+static Uint32 _snapshot_event = 0;
+static SDL_atomic_t _snapshot_wake_pending;
+
+/* The sections of a frame that are timed by the profiler */
+#define FOR_PROFILE_SECTION(X) \
+        X(FRAME, "frame") \
+        X(EVENTS, "events") \
+        X(ASSETS, "assets") \
+        X(LOGIC, "logic") \
+        X(TEXT, "text") \
+        X(CURSOR, "cursor") \
+        X(OVERLAY, "overlay") \
+        X(RENDER, "render") \
+        X(PRESENT, "present") \
+        X(FLUSH, "flush") \
+        X(SWAP, "swap")
+
+enum {
+#define OP(id, name) PROFILE_##id,
+        FOR_PROFILE_SECTION(OP)
+#undef OP
+        NUM_PROFILE_SECTIONS
+};
+
+/* The threads that sections are timed on, numbered as in traces */
+enum {
+        PROFILE_THREAD_RENDER = 1,
+        PROFILE_THREAD_SIMULATION
+};
+
+/* The number of most recent profile events kept for the trace */
+#define PROFILE_RING_SIZE 65536
+/* The number of frames averaged by the profiler overlay */
+#define PROFILE_HISTORY 60
+/* The length of a bar of the profiler overlay per millisecond */
+#define PROFILE_BAR_SCALE 100
+/* The bytes of frame arena per pixel of the profiler overlay */
+#define PROFILE_ARENA_BAR_SCALE 256
+/* The length of a bar of the profiler overlay per heap allocation */
+#define PROFILE_HEAP_BAR_SCALE 10
+/* The rows of the profiler overlay: the sections, then the frame arena
+ * and the heap allocations of the last frame */
+#define NUM_PROFILE_ROWS (NUM_PROFILE_SECTIONS + 2)
+
+/* Whether the profiler is timing sections */
+static int _profiling = 0;
+/* Whether the profiler overlay is shown */
+static int _show_profile = 0;
+/* The ring buffer of the most recent profile events */
+static struct profile_event _profile_events[PROFILE_RING_SIZE];
+/* The number of profile events recorded so far */
+static unsigned long _num_profile_events = 0;
+/* The time spent in each section over the last few frames */
+static Uint64 _profile_history[PROFILE_HISTORY][NUM_PROFILE_SECTIONS];
+/* The frame of the history being recorded */
+static int _profile_frame = 0;
+/* The file to write a trace of the profile events to at exit */
+static const char *_trace_path = NULL;
+/* The time at which profiling started */
+static Uint64 _profile_start = 0;
+
+/* The number of frames drawn so far */
+static unsigned long _frames_drawn = 0;
+/* The number of draw calls made so far */
+static unsigned long _draw_calls = 0;
+/* The number of texture binds made by the render queue so far */
+static unsigned long _texture_binds = 0;
+/* The time at which the game started, in milliseconds */
+static Uint32 _start_ticks = 0;
+/* The number of heap allocations made by the render thread so far */
+static unsigned long _heap_allocations = 0;
+/* The heap allocations made while drawing frames, in the last frame, and
+ * before the frame being drawn */
+static unsigned long _drawing_heap_allocations = 0;
+static unsigned long _frame_heap_allocations = 0;
+static unsigned long _frame_start_heap_allocations = 0;
+/* The last frame that made a heap allocation */
+static unsigned long _last_allocating_frame = 0;
+
+/* The scratch memory of the frame being drawn */
+static struct arena _frame_arena;
 
 /* The game window */
 static SDL_Window *_window = NULL;
@@ -107,224 +917,3091 @@ void die(const char *format, ...) {
         exit(EXIT_FAILURE);
 }
 
-/* Clean up any used memory. */
-static void _clean_up(void) {
-        if (glIsTexture(_font.texture)) {
-                glDeleteTextures(1, &_font.texture);
+/* Set up an empty queue with room for a power of two number of items. */
+void create_queue(struct queue *queue, unsigned capacity, size_t item_size) {
+        queue->items = malloc(capacity * item_size);
+        if (!queue->items) {
+                die("malloc: out of memory\n");
         }
+        queue->item_size = item_size;
+        queue->capacity = capacity;
+        SDL_AtomicSet(&queue->head, 0);
+        SDL_AtomicSet(&queue->tail, 0);
+}
 
-        if (glIsTexture(_cursor_sprite.texture)) {
-                glDeleteTextures(1, &_cursor_sprite.texture);
-        }
+/* Free the items of a queue. */
+void free_queue(struct queue *queue) {
+        free(queue->items);
+        queue->items = NULL;
+}
 
-        if (_context) {
-                SDL_GL_DeleteContext(_context);
-        }
+/* Push a copy of an item onto a queue, and return whether there was
+ * room for it. */
+int push_queue(struct queue *queue, const void *item) {
+        unsigned tail = (unsigned)SDL_AtomicGet(&queue->tail);
+        unsigned head = (unsigned)SDL_AtomicGet(&queue->head);
 
-        if (_window) {
-                SDL_DestroyWindow(_window);
+        if (tail - head == queue->capacity) {
+                return 0;
         }
-}
 
-/* Draw text in a certain font at a certain position. */
-void draw_text(struct font *font,
-               int start_x,
-               int start_y,
-               const char *text)
-{
-        int i;
-        int pen_x = start_x;
-        int pen_y = start_y;
-        
-        for (i = 0; text[i] != '\0'; i++) {
-                int j;
+        /* Only write over a slot once the item in it has been copied
+         * out. */
+        SDL_MemoryBarrierAcquire();
+        memcpy(queue->items + (tail & (queue->capacity - 1)) * queue->item_size,
+               item,
+               queue->item_size);
 
-                if (text[i] == '\n') {
-                        pen_x = start_x;
-                        pen_y -= font->height + 1;
-                } else {
-                        for (j = 0; font->alphabet[j] != '\0'; j++) {
-                                if (font->alphabet[j] == text[i]) {
-                                        SDL_Rect *clip;
-
-                                        clip = &font->clips[j];
-
-                                        {
-                                                GLdouble clip_ratios[] = {
-                                                        ((GLdouble)clip->x)
-                                                          / ((GLdouble)font->image_width),
-                                                        ((GLdouble)clip->y)
-                                                          / ((GLdouble)font->image_height),
-                                                        ((GLdouble)clip->x + (GLdouble)clip->w)
-                                                          / ((GLdouble)font->image_width),
-                                                        ((GLdouble)clip->y + (GLdouble)clip->h)
-                                                          / ((GLdouble)font->image_height)
-                                                };
-                                                glBindTexture(GL_TEXTURE_2D, _font.texture);
-                                                glBegin(GL_POLYGON);
-                                                        glTexCoord2d(clip_ratios[0], clip_ratios[1]);
-                                                        glVertex2d(pen_x, pen_y);
-                                                        glTexCoord2d(clip_ratios[0], clip_ratios[3]);
-                                                        glVertex2d(pen_x, pen_y - clip->h);
-                                                        glTexCoord2d(clip_ratios[2], clip_ratios[3]);
-                                                        glVertex2d(pen_x + clip->w, pen_y - clip->h);
-                                                        glTexCoord2d(clip_ratios[2], clip_ratios[1]);
-                                                        glVertex2d(pen_x + clip->w, pen_y);
-                                                glEnd();
-                                        }
+        /* Only let the item be popped once it has all been copied. */
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&queue->tail, (int)(tail + 1));
 
-                                        pen_x += clip->w + 1;
-                                        break;
-                                }
-                        }
-                }
-        }
+        return 1;
 }
 
-/* Load an OpenGL texture from a file. */
-GLuint load_gl_texture_and_handle_surface(
-                const char *path,
-                void (*surface_handler)(SDL_Surface*, void*),
-                void *data,
-                void (*print_error)(const char*, ...)) {
-        SDL_Surface *surf;
-        SDL_Surface *converted;
-        GLuint tex;
+/* Pop the oldest item of a queue into a buffer, and return whether there
+ * was one. */
+int pop_queue(struct queue *queue, void *item) {
+        unsigned head = (unsigned)SDL_AtomicGet(&queue->head);
+        unsigned tail = (unsigned)SDL_AtomicGet(&queue->tail);
 
-        /* Load the image. */
-        surf = IMG_Load(path);
-        if (!surf) {
-                print_error("IMG_Load: %s\n", IMG_GetError());
+        if (head == tail) {
                 return 0;
         }
 
-        /* Convert the surface to a format that OpenGL can parse. */
-        converted = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
-        if (!converted) {
-                SDL_FreeSurface(surf);
-                print_error("SDL_ConvertSurfaceFormat: %s\n", SDL_GetError());
-                return 0;
+        /* Only read the item once all of it has been pushed. */
+        SDL_MemoryBarrierAcquire();
+        memcpy(item,
+               queue->items + (head & (queue->capacity - 1)) * queue->item_size,
+               queue->item_size);
+
+        /* Only let the slot be pushed into once it has all been copied. */
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&queue->head, (int)(head + 1));
+
+        return 1;
+}
+
+/* Grow a buffer of elements to hold at least a certain number of them. */
+static void *_grow_buffer(void *buffer, int *capacity, int needed, size_t size) {
+        int new_capacity = *capacity ? *capacity : 64;
+
+        if (needed <= *capacity) {
+                return buffer;
         }
 
-        /* Turn the texture into an OpenGL texture. */
-        {
-                glGenTextures(1, &tex);
-                glBindTexture(GL_TEXTURE_2D, tex);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-                glTexImage2D(GL_TEXTURE_2D,
-                             0,
-                             GL_RGB8,
-                             converted->w,
-                             converted->h,
-                             0,
-                             GL_RGB,
-                             GL_UNSIGNED_BYTE,
-                             converted->pixels);
+        while (new_capacity < needed) {
+                new_capacity *= 2;
         }
 
-        /* Send the surface to the user-supplied surface handler
-         * for extra processing. */
-        surface_handler(surf, data);
+        buffer = realloc(buffer, (size_t)new_capacity * size);
+        if (!buffer) {
+                die("realloc: out of memory\n");
+        }
+        *capacity = new_capacity;
+        _heap_allocations++;
 
-        /* Free the surfaces. */
-        SDL_FreeSurface(converted);
-        SDL_FreeSurface(surf);
+        return buffer;
+}
 
-        /* Return the loaded texture ID. */
-        return tex;
+/* Set up an arena with a block of a certain size. */
+void create_arena(struct arena *arena, size_t size) {
+        memset(arena, 0, sizeof *arena);
+        arena->base = malloc(size);
+        if (!arena->base) {
+                die("malloc: out of memory\n");
+        }
+        arena->size = size;
+        _heap_allocations++;
 }
 
+/* Get memory from an arena that lasts until the arena is reset. */
+void *arena_alloc(struct arena *arena, size_t size) {
+        struct arena_block *block;
 
-/* Load a texture from a file. */
-SDL_Texture *load_texture_and_handle_surface(
-                SDL_Renderer *renderer,
-                const char *path,
-                void (*surface_handler)(SDL_Surface*, void*),
-                void *data,
-                void (*print_error)(const char*, ...)) {
-        SDL_Surface *surf;
-        SDL_Texture *tex;
+        size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+        arena->allocations++;
 
-        surf = IMG_Load(path);
-        if (!surf) {
-                print_error("IMG_Load: %s\n", IMG_GetError());
-                return NULL;
-        }
+        if (arena->size - arena->used >= size) {
+                void *memory = arena->base + arena->used;
 
-        tex = SDL_CreateTextureFromSurface(renderer, surf);
-        if (!tex) {
-                const char *error = SDL_GetError();
-                SDL_FreeSurface(surf);
-                print_error("SDL_CreateTextureFromSurface: %s\n", error);
-                return NULL;
+                arena->used += size;
+                return memory;
         }
 
-        surface_handler(surf, data);
-        SDL_FreeSurface(surf);
+        /* Borrow a block from the heap, with the memory handed out after
+         * a header padded to the alignment. */
+        block = malloc(ARENA_ALIGNMENT + size);
+        if (!block) {
+                die("malloc: out of memory\n");
+        }
+        _heap_allocations++;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->borrowed += size;
 
-        return tex;
+        return (char *)block + ARENA_ALIGNMENT;
 }
 
-/* Get sprite dimensions from a surface. */
-void get_sprite_dims_from_surface(SDL_Surface *surf, void *sprite_ptr) {
-        struct sprite *sprite = sprite_ptr;
+/* Give back everything that an arena has handed out, growing it to fit
+ * if it had to borrow. */
+void reset_arena(struct arena *arena) {
+        size_t used = arena->used + arena->borrowed;
 
-        sprite->width = surf->w;
-        sprite->height = surf->h;
-}
+        if (used > arena->peak) {
+                arena->peak = used;
+        }
+        arena->last_used = used;
+        arena->last_allocations = arena->allocations;
 
-/* Get font information (clips & height) from a surface. */
-void get_font_info_from_surface(SDL_Surface *surf, void *font_ptr) {
-        struct font *font = font_ptr;
-        int i;
-        int x;
+        if (arena->blocks) {
+                size_t size = arena->size;
 
-        font->image_width = surf->w;
-        font->image_height = surf->h;
+                while (arena->blocks) {
+                        struct arena_block *next = arena->blocks->next;
 
-        x = 1;
-        for (i = 0; font->alphabet[i] != '\0'; i++) {
-                int j;
+                        free(arena->blocks);
+                        arena->blocks = next;
+                }
+                while (size < used) {
+                        size *= 2;
+                }
 
-                font->clips[i].x = x;
-                font->clips[i].y = 0;
+                free(arena->base);
+                arena->base = malloc(size);
+                if (!arena->base) {
+                        die("malloc: out of memory\n");
+                }
+                arena->size = size;
+                _heap_allocations++;
+        }
 
-                font->clips[i].w = 0;
-                for (j = x; j < surf->w; j++) {
-                        char *pixels_bytes;
-                        int locked = 0;
-                        int is_divider = 0;
+        arena->used = 0;
+        arena->borrowed = 0;
+        arena->allocations = 0;
+}
 
-                        if (SDL_MUSTLOCK(surf)) {
-                                SDL_LockSurface(surf);
-                                locked = 1;
-                        }
+/* Free the memory of an arena. */
+void free_arena(struct arena *arena) {
+        reset_arena(arena);
+        free(arena->base);
+        arena->base = NULL;
+        arena->size = 0;
+}
 
-                        pixels_bytes = surf->pixels;
-                        is_divider = (pixels_bytes[surf->pitch * (surf->h - 1) + j]
-                                      == pixels_bytes[surf->pitch * (surf->h - 1)]);
+/* Reset the frame arena at the end of a frame, and note the heap
+ * allocations made while drawing it. */
+void finish_frame_allocations(void) {
+        reset_arena(&_frame_arena);
+        _frame_heap_allocations = _heap_allocations - _frame_start_heap_allocations;
+        if (_frame_heap_allocations > 0) {
+                _last_allocating_frame = _frames_drawn;
+        }
+        _drawing_heap_allocations += _frame_heap_allocations;
+        _frame_start_heap_allocations = _heap_allocations;
+}
 
-                        if (locked) {
-                                SDL_UnlockSurface(surf);
-                        }
+/* Set up a pool of a number of items of a certain size. */
+void create_pool(struct pool *pool, int capacity, size_t item_size) {
+        int i;
 
-                        if (is_divider) {
-                                font->clips[i].w = j - x;
-                                x = j + 1;
-                                break;
-                        }
-                }
+        /* Free items hold the link to the next, so keep them big enough
+         * and aligned for a pointer. */
+        item_size = (item_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
 
-                font->clips[i].h = surf->h - 1;
+        pool->items = malloc((size_t)capacity * item_size);
+        if (!pool->items) {
+                die("malloc: out of memory\n");
         }
+        _heap_allocations++;
+        pool->item_size = item_size;
+        pool->capacity = capacity;
+        pool->free_items = NULL;
+        pool->num_used = 0;
+        pool->peak = 0;
 
-        font->height = surf->h;
+        /* Hand the items out from the first up. */
+        for (i = capacity - 1; i >= 0; i--) {
+                void **item = (void **)(pool->items + (size_t)i * item_size);
+
+                *item = pool->free_items;
+                pool->free_items = item;
+        }
 }
 
+/* Take a cleared item from a pool, or NULL if they are all in use. */
+void *pool_alloc(struct pool *pool) {
+        void **item = pool->free_items;
+
+        if (!item) {
+                return NULL;
+        }
+
+        pool->free_items = *item;
+        memset(item, 0, pool->item_size);
+        pool->num_used++;
+        if (pool->num_used > pool->peak) {
+                pool->peak = pool->num_used;
+        }
+
+        return item;
+}
+
+/* Give an item back to its pool. */
+void pool_free(struct pool *pool, void *item) {
+        *(void **)item = pool->free_items;
+        pool->free_items = item;
+        pool->num_used--;
+}
+
+/* Free the items of a pool. */
+void free_pool(struct pool *pool) {
+        free(pool->items);
+        pool->items = NULL;
+        pool->free_items = NULL;
+}
+
+/* Expand quads into interleaved texcoord/vertex pairs, four per quad,
+ * wound the same way as the old GL_POLYGON glyphs. */
+static GLfloat *_expand_quads(const struct quad *quads, int num_quads) {
+        GLfloat *vertices;
+        GLfloat *v;
+        int i;
+
+        vertices = arena_alloc(&_frame_arena, (size_t)num_quads * 16 * sizeof *vertices);
+        v = vertices;
+        for (i = 0; i < num_quads; i++) {
+                const struct quad *q = &quads[i];
+
+                *v++ = q->s0; *v++ = q->t0; *v++ = q->x0; *v++ = q->y0;
+                *v++ = q->s0; *v++ = q->t1; *v++ = q->x0; *v++ = q->y1;
+                *v++ = q->s1; *v++ = q->t1; *v++ = q->x1; *v++ = q->y1;
+                *v++ = q->s1; *v++ = q->t0; *v++ = q->x1; *v++ = q->y0;
+        }
+
+        return vertices;
+}
+
+/* Draw expanded quads from client memory or from the bound buffer. */
+static void _draw_expanded_quads(const GLfloat *vertices, int num_quads) {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(GLfloat), vertices);
+        glVertexPointer(2, GL_FLOAT, 4 * sizeof(GLfloat), vertices + 2);
+        glDrawArrays(GL_QUADS, 0, num_quads * 4);
+        _draw_calls++;
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+/* Set up fixed-function OpenGL for the legacy renderer. */
+static int _init_legacy_renderer(void) {
+        glShadeModel(GL_FLAT);
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        gluOrtho2D(0.0f, (GLdouble)WINDOW_WIDTH, 0.0f, (GLdouble)WINDOW_HEIGHT);
+        glMatrixMode(GL_MODELVIEW);
+
+        /* Everything drawn is textured. */
+        glEnable(GL_TEXTURE_2D);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+
+        return 1;
+}
+
+/* The legacy renderer has nothing of its own to free. */
+static void _quit_legacy_renderer(void) {
+}
+
+/* Draw quads from client memory using a single vertex array draw call. */
+static void _draw_legacy_quads(const struct quad *quads, int num_quads) {
+        _draw_expanded_quads(_expand_quads(quads, num_quads), num_quads);
+}
+
+/* Upload quads to a mesh buffer as expanded vertices. */
+static void _upload_legacy_mesh(GLuint buffer,
+                                const struct quad *quads,
+                                int num_quads)
+{
+        _glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        _glBufferData(GL_ARRAY_BUFFER,
+                      (GLsizeiptr)num_quads * 16 * sizeof(GLfloat),
+                      _expand_quads(quads, num_quads),
+                      GL_STATIC_DRAW);
+        _glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* Draw the expanded vertices of a mesh buffer, moved to a position. */
+static void _draw_legacy_mesh(GLuint buffer,
+                              int num_quads,
+                              GLfloat x,
+                              GLfloat y)
+{
+        glPushMatrix();
+        glTranslatef(x, y, 0.0f);
+        _glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        _draw_expanded_quads(NULL, num_quads);
+        _glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glPopMatrix();
+}
+
+/* The vertex shader of the core renderer.  Each instance is a quad, and
+ * its four corners come from the vertex ID so no vertex data is needed. */
+static const char _quad_vertex_shader[] =
+        "#version 330 core\n"
+        "layout(location = 0) in vec4 rect;\n"
+        "layout(location = 1) in vec4 clip;\n"
+        "uniform vec2 screen;\n"
+        "uniform vec2 offset;\n"
+        "out vec2 texcoord;\n"
+        "void main() {\n"
+        "        vec2 corner = vec2(gl_VertexID >> 1, gl_VertexID & 1);\n"
+        "        vec2 position = mix(rect.xy, rect.zw, corner) + offset;\n"
+        "        texcoord = mix(clip.xy, clip.zw, corner);\n"
+        "        gl_Position = vec4(position / screen * 2.0 - 1.0, 0.0, 1.0);\n"
+        "}\n";
+
+/* The fragment shader of the core renderer, which decals the texture
+ * like the legacy renderer does. */
+static const char _quad_fragment_shader[] =
+        "#version 330 core\n"
+        "uniform sampler2D image;\n"
+        "in vec2 texcoord;\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "        color = vec4(texture(image, texcoord).rgb, 1.0);\n"
+        "}\n";
+
+/* Compile a shader, printing why if it fails. */
+static GLuint _compile_shader(GLenum type, const char *source) {
+        GLuint shader = _glCreateShader(type);
+        GLint compiled;
+
+        _glShaderSource(shader, 1, &source, NULL);
+        _glCompileShader(shader);
+        _glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (!compiled) {
+                char log[1024];
+
+                _glGetShaderInfoLog(shader, sizeof log, NULL, log);
+                fprintf(stderr, "lambhorn: cannot compile a shader: %s\n", log);
+                _glDeleteShader(shader);
+                return 0;
+        }
+
+        return shader;
+}
+
+/* Move whatever the core renderer draws next to a position. */
+static void _move_core_quads(GLfloat x, GLfloat y) {
+        if (x != _quad_offset_x || y != _quad_offset_y) {
+                _glUniform2f(_quad_offset_location, x, y);
+                _quad_offset_x = x;
+                _quad_offset_y = y;
+        }
+}
+
+/* Point the quad attributes at the quads in a buffer. */
+static void _point_quad_attribs(GLuint buffer, size_t offset) {
+        _glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        _glVertexAttribPointer(0,
+                               4,
+                               GL_FLOAT,
+                               GL_FALSE,
+                               sizeof(struct quad),
+                               (const GLvoid *)offset);
+        _glVertexAttribPointer(1,
+                               4,
+                               GL_FLOAT,
+                               GL_FALSE,
+                               sizeof(struct quad),
+                               (const GLvoid *)(offset + 4 * sizeof(GLfloat)));
+}
+
+/* Set up the shaders, vertex array and ring buffer of the core
+ * renderer. */
+static int _init_core_renderer(void) {
+        GLuint vertex_shader;
+        GLuint fragment_shader;
+        GLint linked;
+
+#define OP(type, name) if (!_##name) { return 0; }
+        FOR_GL_PROC(OP)
+        FOR_CORE_GL_PROC(OP)
+#undef OP
+
+        vertex_shader = _compile_shader(GL_VERTEX_SHADER, _quad_vertex_shader);
+        fragment_shader = _compile_shader(GL_FRAGMENT_SHADER, _quad_fragment_shader);
+        if (!vertex_shader || !fragment_shader) {
+                return 0;
+        }
+
+        _quad_program = _glCreateProgram();
+        _glAttachShader(_quad_program, vertex_shader);
+        _glAttachShader(_quad_program, fragment_shader);
+        _glLinkProgram(_quad_program);
+        _glDeleteShader(vertex_shader);
+        _glDeleteShader(fragment_shader);
+        _glGetProgramiv(_quad_program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+                char log[1024];
+
+                _glGetProgramInfoLog(_quad_program, sizeof log, NULL, log);
+                fprintf(stderr, "lambhorn: cannot link the shaders: %s\n", log);
+                return 0;
+        }
+
+        _glUseProgram(_quad_program);
+        _glUniform1i(_glGetUniformLocation(_quad_program, "image"), 0);
+        _glUniform2f(_glGetUniformLocation(_quad_program, "screen"),
+                     (GLfloat)WINDOW_WIDTH,
+                     (GLfloat)WINDOW_HEIGHT);
+        _quad_offset_location = _glGetUniformLocation(_quad_program, "offset");
+        _glUniform2f(_quad_offset_location, 0.0f, 0.0f);
+        _quad_offset_x = 0.0f;
+        _quad_offset_y = 0.0f;
+
+        /* Each quad is one instance. */
+        _glGenVertexArrays(1, &_quad_vertex_array);
+        _glBindVertexArray(_quad_vertex_array);
+        _glEnableVertexAttribArray(0);
+        _glEnableVertexAttribArray(1);
+        _glVertexAttribDivisor(0, 1);
+        _glVertexAttribDivisor(1, 1);
+
+        /* Keep the ring buffer mapped if the driver can, so that quads
+         * are written straight into it. */
+        _glGenBuffers(1, &_ring_buffer);
+        _glBindBuffer(GL_ARRAY_BUFFER, _ring_buffer);
+        if (_glBufferStorage && SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")) {
+                GLbitfield flags = GL_MAP_WRITE_BIT
+                                   | GL_MAP_PERSISTENT_BIT
+                                   | GL_MAP_COHERENT_BIT;
+
+                _glBufferStorage(GL_ARRAY_BUFFER, RING_SIZE, NULL, flags);
+                _ring_data = _glMapBufferRange(GL_ARRAY_BUFFER, 0, RING_SIZE, flags);
+        }
+        if (!_ring_data) {
+                _glBufferData(GL_ARRAY_BUFFER, RING_SIZE, NULL, GL_STREAM_DRAW);
+        }
+
+        return 1;
+}
+
+/* Free the shaders, vertex array and ring buffer of the core renderer. */
+static void _quit_core_renderer(void) {
+        int i;
+
+        for (i = 0; i < RING_SEGMENTS; i++) {
+                if (_ring_fences[i]) {
+                        _glDeleteSync(_ring_fences[i]);
+                        _ring_fences[i] = NULL;
+                }
+        }
+
+        if (_ring_buffer) {
+                if (_ring_data) {
+                        _glBindBuffer(GL_ARRAY_BUFFER, _ring_buffer);
+                        _glUnmapBuffer(GL_ARRAY_BUFFER);
+                        _ring_data = NULL;
+                }
+                _glDeleteBuffers(1, &_ring_buffer);
+                _ring_buffer = 0;
+        }
+
+        if (_quad_vertex_array) {
+                _glDeleteVertexArrays(1, &_quad_vertex_array);
+                _quad_vertex_array = 0;
+        }
+
+        if (_quad_program) {
+                _glDeleteProgram(_quad_program);
+                _quad_program = 0;
+        }
+}
+
+/* Reserve some bytes of the ring buffer and return their offset.  A
+ * reservation never straddles two segments: one that does not fit in
+ * the rest of the current segment starts the next one.  That way every
+ * draw reading a segment is issued before the segment is fenced, and the
+ * next segment is only written once the GPU has passed its fence. */
+static size_t _reserve_ring(size_t size) {
+        size_t segment_size = RING_SIZE / RING_SEGMENTS;
+        size_t offset = _ring_head;
+
+        if (offset + size > (size_t)(_ring_segment + 1) * segment_size) {
+                _ring_fences[_ring_segment] = _glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                _ring_segment = (_ring_segment + 1) % RING_SEGMENTS;
+                if (_ring_fences[_ring_segment]) {
+                        _glClientWaitSync(_ring_fences[_ring_segment],
+                                          GL_SYNC_FLUSH_COMMANDS_BIT,
+                                          GL_TIMEOUT_IGNORED);
+                        _glDeleteSync(_ring_fences[_ring_segment]);
+                        _ring_fences[_ring_segment] = NULL;
+                }
+                offset = (size_t)_ring_segment * segment_size;
+        }
+
+        _ring_head = offset + size;
+
+        return offset;
+}
+
+/* Draw quads as instances streamed through the ring buffer, in as few
+ * draw calls as fit in a segment of it. */
+static void _draw_core_quads(const struct quad *quads, int num_quads) {
+        int max_quads = (int)(RING_SIZE / RING_SEGMENTS / sizeof *quads);
+
+        _move_core_quads(0.0f, 0.0f);
+        while (num_quads > 0) {
+                int n = num_quads < max_quads ? num_quads : max_quads;
+                size_t size = (size_t)n * sizeof *quads;
+                size_t offset = _reserve_ring(size);
+
+                if (_ring_data) {
+                        memcpy(_ring_data + offset, quads, size);
+                        _glBindBuffer(GL_ARRAY_BUFFER, _ring_buffer);
+                } else {
+                        void *data;
+
+                        _glBindBuffer(GL_ARRAY_BUFFER, _ring_buffer);
+                        data = _glMapBufferRange(GL_ARRAY_BUFFER,
+                                                 (GLintptr)offset,
+                                                 (GLsizeiptr)size,
+                                                 GL_MAP_WRITE_BIT
+                                                 | GL_MAP_INVALIDATE_RANGE_BIT
+                                                 | GL_MAP_UNSYNCHRONIZED_BIT);
+                        if (!data) {
+                                die("glMapBufferRange: cannot map the ring buffer\n");
+                        }
+                        memcpy(data, quads, size);
+                        _glUnmapBuffer(GL_ARRAY_BUFFER);
+                }
+
+                _point_quad_attribs(_ring_buffer, offset);
+                _glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, n);
+                _draw_calls++;
+
+                quads += n;
+                num_quads -= n;
+        }
+}
+
+/* Upload quads to a mesh buffer as they are, one instance each. */
+static void _upload_core_mesh(GLuint buffer,
+                              const struct quad *quads,
+                              int num_quads)
+{
+        _glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        _glBufferData(GL_ARRAY_BUFFER,
+                      (GLsizeiptr)num_quads * sizeof *quads,
+                      quads,
+                      GL_STATIC_DRAW);
+}
+
+/* Draw the quads of a mesh buffer as instances, moved to a position. */
+static void _draw_core_mesh(GLuint buffer,
+                            int num_quads,
+                            GLfloat x,
+                            GLfloat y)
+{
+        _move_core_quads(x, y);
+        _point_quad_attribs(buffer, 0);
+        _glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_quads);
+        _draw_calls++;
+}
+
+/* The renderers, in the order they are tried */
+static const struct renderer _core_renderer = {
+        "core",
+        1,
+        &_init_core_renderer,
+        &_quit_core_renderer,
+        &_draw_core_quads,
+        &_upload_core_mesh,
+        &_draw_core_mesh
+};
+static const struct renderer _legacy_renderer = {
+        "legacy",
+        0,
+        &_init_legacy_renderer,
+        &_quit_legacy_renderer,
+        &_draw_legacy_quads,
+        &_upload_legacy_mesh,
+        &_draw_legacy_mesh
+};
+static const struct renderer *_renderers[] = {
+        &_core_renderer,
+        &_legacy_renderer,
+        NULL
+};
+
+/* Add a command to the render queue. */
+static void _queue_render_command(GLuint texture,
+                                  GLuint buffer,
+                                  int first,
+                                  int num_quads,
+                                  GLfloat x,
+                                  GLfloat y)
+{
+        struct render_command *command;
+
+        _render_commands = _grow_buffer(_render_commands,
+                                        &_max_render_commands,
+                                        _num_render_commands + 1,
+                                        sizeof *_render_commands);
+        command = &_render_commands[_num_render_commands];
+        command->key = (Uint64)_render_layer << 56
+                       | (Uint64)texture << 24
+                       | (Uint64)(buffer == 0) << 23
+                       | (Uint64)(_num_render_commands & 0x7fffff);
+        command->texture = texture;
+        command->buffer = buffer;
+        command->first = first;
+        command->num_quads = num_quads;
+        command->x = x;
+        command->y = y;
+        _num_render_commands++;
+}
+
+/* Set the layer that the following draws go to. */
+void set_render_layer(enum render_layer layer) {
+        _render_layer = layer;
+}
+
+/* Queue quads from a texture to be drawn at the end of the frame. */
+void draw_quads(GLuint texture, const struct quad *quads, int num_quads) {
+        if (num_quads == 0) {
+                return;
+        }
+
+        _render_quads = _grow_buffer(_render_quads,
+                                     &_max_render_quads,
+                                     _num_render_quads + num_quads,
+                                     sizeof *_render_quads);
+        memcpy(&_render_quads[_num_render_quads], quads, (size_t)num_quads * sizeof *quads);
+        _queue_render_command(texture, 0, _num_render_quads, num_quads, 0.0f, 0.0f);
+        _num_render_quads += num_quads;
+}
+
+/* Queue a mesh buffer of quads to be drawn at the end of the frame,
+ * moved to a position. */
+void draw_mesh(GLuint texture,
+               GLuint buffer,
+               int num_quads,
+               GLfloat x,
+               GLfloat y)
+{
+        if (num_quads == 0) {
+                return;
+        }
+
+        _queue_render_command(texture, buffer, 0, num_quads, x, y);
+}
+
+/* Compare render commands for sorting. */
+static int _compare_render_commands(const void *a, const void *b) {
+        Uint64 x = ((const struct render_command *)a)->key;
+        Uint64 y = ((const struct render_command *)b)->key;
+
+        return (x > y) - (x < y);
+}
+
+/* Draw everything in the render queue, sorted so that each texture is
+ * bound once and runs of quads from the same texture are drawn together. */
+void flush_render_queue(void) {
+        GLuint bound_texture = 0;
+        int i = 0;
+
+        qsort(_render_commands,
+              (size_t)_num_render_commands,
+              sizeof *_render_commands,
+              &_compare_render_commands);
+
+        while (i < _num_render_commands) {
+                struct render_command *command = &_render_commands[i];
+                int end;
+                int num_quads;
+
+                /* Textures may have been bound behind the queue's back
+                 * since the last flush, so always bind the first. */
+                if (i == 0 || command->texture != bound_texture) {
+                        glBindTexture(GL_TEXTURE_2D, command->texture);
+                        bound_texture = command->texture;
+                        _texture_binds++;
+                }
+
+                if (command->buffer) {
+                        _renderer->draw_mesh(command->buffer,
+                                             command->num_quads,
+                                             command->x,
+                                             command->y);
+                        i++;
+                        continue;
+                }
+
+                /* Merge the quads of the following commands with the
+                 * same texture into one draw. */
+                num_quads = command->num_quads;
+                for (end = i + 1; end < _num_render_commands; end++) {
+                        if (_render_commands[end].buffer
+                            || _render_commands[end].texture != command->texture) {
+                                break;
+                        }
+                        num_quads += _render_commands[end].num_quads;
+                }
+
+                if (end == i + 1) {
+                        _renderer->draw_quads(&_render_quads[command->first], num_quads);
+                } else {
+                        struct quad *merged_quads;
+                        struct quad *q;
+
+                        merged_quads = arena_alloc(&_frame_arena,
+                                                   (size_t)num_quads * sizeof *merged_quads);
+                        q = merged_quads;
+                        for (; i < end; i++) {
+                                memcpy(q,
+                                       &_render_quads[_render_commands[i].first],
+                                       (size_t)_render_commands[i].num_quads * sizeof *q);
+                                q += _render_commands[i].num_quads;
+                        }
+                        _renderer->draw_quads(merged_quads, num_quads);
+                }
+                i = end;
+        }
+
+        _num_render_commands = 0;
+        _num_render_quads = 0;
+        _render_layer = RENDER_LAYER_MENU;
+        _flushed_text_mesh_clock = _text_mesh_clock;
+}
+
+/* Free the memory used by the render queue. */
+static void _free_render_queue(void) {
+        free(_render_commands);
+        _render_commands = NULL;
+        _num_render_commands = 0;
+        _max_render_commands = 0;
+        free(_render_quads);
+        _render_quads = NULL;
+        _num_render_quads = 0;
+        _max_render_quads = 0;
+}
+
+/* Start a new batch of text in a certain font. */
+void text_batch_begin(struct text_batch *batch, struct font *font) {
+        batch->font = font;
+        batch->num_quads = 0;
+}
+
+/* Add the glyphs of some text at a certain position to a batch. */
+void text_batch_add(struct text_batch *batch,
+                    int start_x,
+                    int start_y,
+                    const char *text)
+{
+        struct font *font = batch->font;
+        const unsigned char *c;
+        struct quad *q;
+        GLfloat pen_x = (GLfloat)start_x;
+        GLfloat pen_y = (GLfloat)start_y;
+
+        /* Make room for every character up front. */
+        batch->quads = _grow_buffer(batch->quads,
+                                    &batch->max_quads,
+                                    batch->num_quads + (int)strlen(text),
+                                    sizeof(struct quad));
+        q = &batch->quads[batch->num_quads];
+
+        for (c = (const unsigned char *)text; *c != '\0'; c++) {
+                const struct glyph *glyph = font->glyph_map[*c];
+
+                if (*c == '\n') {
+                        pen_x = (GLfloat)start_x;
+                        pen_y -= (GLfloat)(font->height + 1);
+                } else if (glyph) {
+                        q->x0 = pen_x;
+                        q->y0 = pen_y;
+                        q->x1 = pen_x + glyph->width;
+                        q->y1 = pen_y - glyph->height;
+                        q->s0 = glyph->s0;
+                        q->t0 = glyph->t0;
+                        q->s1 = glyph->s1;
+                        q->t1 = glyph->t1;
+                        q++;
+
+                        pen_x += glyph->advance;
+                }
+        }
+
+        batch->num_quads = (int)(q - batch->quads);
+}
+
+/* Queue every string in a batch to be drawn together. */
+void text_batch_draw(struct text_batch *batch) {
+        draw_quads(batch->font->texture, batch->quads, batch->num_quads);
+}
+
+/* Free the memory used by a batch. */
+void text_batch_free(struct text_batch *batch) {
+        free(batch->quads);
+        batch->quads = NULL;
+        batch->num_quads = 0;
+        batch->max_quads = 0;
+}
+
+/* Draw text in a certain font at a certain position. */
+void draw_text(struct font *font,
+               int start_x,
+               int start_y,
+               const char *text)
+{
+        text_batch_begin(&_text_batch, font);
+        text_batch_add(&_text_batch, start_x, start_y, text);
+        text_batch_draw(&_text_batch);
+}
+
+/* Measure the width in pixels of some characters on one line. */
+static int _measure_text(const struct font *font, const char *text, int length) {
+        GLfloat pen = 0.0f;
+        GLfloat right = 0.0f;
+        int i;
+
+        for (i = 0; i < length; i++) {
+                const struct glyph *glyph = font->glyph_map[(unsigned char)text[i]];
+
+                if (glyph) {
+                        right = pen + glyph->width;
+                        pen += glyph->advance;
+                }
+        }
+
+        return (int)right;
+}
+
+/* Cut the last line of a layout short so that "..." fits after it. */
+static void _add_ellipsis(struct text_layout *layout, struct text_line *line) {
+        const char *text = layout->text + line->start;
+        int ellipsis_width = _measure_text(layout->font, "...", 3) + 1;
+
+        while (line->length > 0
+               && (text[line->length - 1] == ' '
+                   || (layout->width > 0
+                       && line->width + ellipsis_width > layout->width))) {
+                line->length--;
+                line->width = _measure_text(layout->font, text, line->length);
+        }
+        line->ellipsis = 1;
+}
+
+/* Wrap the text of a layout into lines, breaking between words where it
+ * can and inside words that are wider than the box. */
+static void _wrap_text(struct text_layout *layout) {
+        const struct font *font = layout->font;
+        const char *text = layout->text;
+        struct text_line *lines;
+        int num_lines = 0;
+        int start = 0;
+
+        /* No text has more lines than characters, so wrap into scratch
+         * space that big and keep only what is used. */
+        lines = arena_alloc(&_frame_arena, (strlen(text) + 1) * sizeof *lines);
+
+        while (start >= 0) {
+                struct text_line *line = &lines[num_lines++];
+                GLfloat pen = 0.0f;
+                int next = -1;
+                int i = start;
+
+                line->start = start;
+                line->length = 0;
+                line->width = 0;
+                line->ellipsis = 0;
+
+                while (1) {
+                        GLfloat word_pen = pen;
+                        GLfloat word_right = 0.0f;
+                        int word_start;
+                        int word_end;
+
+                        /* Take the spaces before a word, then as much of
+                         * the word as fits. */
+                        for (; text[i] == ' '; i++) {
+                                if (font->glyph_map[' ']) {
+                                        word_pen += font->glyph_map[' ']->advance;
+                                }
+                        }
+                        word_start = i;
+                        for (word_end = i;
+                             text[word_end] != '\0'
+                             && text[word_end] != '\n'
+                             && text[word_end] != ' ';
+                             word_end++) {
+                                const struct glyph *glyph = font->glyph_map[(unsigned char)text[word_end]];
+
+                                if (!glyph) {
+                                        continue;
+                                }
+                                if (layout->width > 0
+                                    && word_pen + glyph->width > (GLfloat)layout->width) {
+                                        break;
+                                }
+                                word_right = word_pen + glyph->width;
+                                word_pen += glyph->advance;
+                        }
+
+                        if (word_end == word_start
+                            && (text[word_end] == '\0' || text[word_end] == '\n')) {
+                                /* The line ends, leaving out trailing
+                                 * spaces. */
+                                next = text[word_end] == '\n' ? word_end + 1 : -1;
+                                break;
+                        }
+                        if (text[word_end] == '\0'
+                            || text[word_end] == '\n'
+                            || text[word_end] == ' ') {
+                                /* The whole word fits. */
+                                line->length = word_end - start;
+                                line->width = (int)word_right;
+                                pen = word_pen;
+                                i = word_end;
+                                continue;
+                        }
+
+                        /* The word runs past the box, so it starts the
+                         * next line, unless it is wider than the box and
+                         * has to be split. */
+                        if (line->length > 0) {
+                                next = word_start;
+                                break;
+                        }
+                        if (word_end == word_start) {
+                                word_end++;
+                                word_right = (GLfloat)_measure_text(font, text + start, word_end - start);
+                        }
+                        line->length = word_end - start;
+                        line->width = (int)word_right;
+                        next = word_end;
+                        break;
+                }
+
+                if (next >= 0 && text[next] == '\0') {
+                        next = -1;
+                }
+                if (next >= 0
+                    && layout->max_lines > 0
+                    && num_lines == layout->max_lines) {
+                        _add_ellipsis(layout, line);
+                        break;
+                }
+                start = next;
+        }
+
+        layout->lines = _grow_buffer(layout->lines,
+                                     &layout->lines_capacity,
+                                     num_lines,
+                                     sizeof *layout->lines);
+        memcpy(layout->lines, lines, (size_t)num_lines * sizeof *lines);
+        layout->num_lines = num_lines;
+        layout->font_generation = font->generation;
+        _text_layouts_built++;
+}
+
+/* Hash the key of a text layout. */
+static unsigned long _hash_text_layout_key(const struct font *font,
+                                           int width,
+                                           int align,
+                                           int max_lines,
+                                           const char *text)
+{
+        unsigned long hash = 2166136261UL;
+        const unsigned char *c;
+
+        for (c = (const unsigned char *)text; *c != '\0'; c++) {
+                hash = (hash ^ *c) * 16777619UL;
+        }
+        hash = (hash ^ (unsigned long)(size_t)font) * 16777619UL;
+        hash = (hash ^ (unsigned long)width) * 16777619UL;
+        hash = (hash ^ (unsigned long)align) * 16777619UL;
+        hash = (hash ^ (unsigned long)max_lines) * 16777619UL;
+
+        return hash;
+}
+
+/* Lay out text to fit a box of a certain width, with at most a certain
+ * number of lines.  Layouts are kept, so text is only wrapped again when
+ * it, the box or the font changes. */
+const struct text_layout *layout_text(struct font *font,
+                                      int width,
+                                      int align,
+                                      int max_lines,
+                                      const char *text)
+{
+        unsigned long hash = _hash_text_layout_key(font, width, align, max_lines, text);
+        struct text_layout *victim = NULL;
+        int i;
+
+        for (i = 0; i < TEXT_LAYOUT_CACHE_PROBES; i++) {
+                struct text_layout *layout;
+
+                layout = &_text_layouts[(hash + i) % TEXT_LAYOUT_CACHE_SIZE];
+                if (layout->text
+                    && layout->hash == hash
+                    && layout->font == font
+                    && layout->width == width
+                    && layout->align == align
+                    && layout->max_lines == max_lines
+                    && strcmp(layout->text, text) == 0) {
+                        if (layout->font_generation != font->generation) {
+                                _wrap_text(layout);
+                        }
+                        layout->last_used = ++_text_layout_clock;
+                        return layout;
+                }
+
+                if (!victim
+                    || (victim->text
+                        && (!layout->text || layout->last_used < victim->last_used))) {
+                        victim = layout;
+                }
+        }
+
+        /* Take over the free or least recently used slot, keeping its
+         * memory, so that a warm cache allocates nothing. */
+        victim->text = _grow_buffer(victim->text,
+                                    &victim->text_capacity,
+                                    (int)strlen(text) + 1,
+                                    1);
+        strcpy(victim->text, text);
+        victim->font = font;
+        victim->width = width;
+        victim->align = align;
+        victim->max_lines = max_lines;
+        victim->hash = hash;
+        _wrap_text(victim);
+        victim->last_used = ++_text_layout_clock;
+
+        return victim;
+}
+
+/* Free the text layout cache. */
+static void _free_text_layouts(void) {
+        int i;
+
+        for (i = 0; i < TEXT_LAYOUT_CACHE_SIZE; i++) {
+                free(_text_layouts[i].text);
+                _text_layouts[i].text = NULL;
+                _text_layouts[i].text_capacity = 0;
+                free(_text_layouts[i].lines);
+                _text_layouts[i].lines = NULL;
+                _text_layouts[i].lines_capacity = 0;
+        }
+}
+
+/* Add the glyphs of some characters on one line to a batch. */
+static struct quad *_add_glyphs(const struct font *font,
+                                struct quad *q,
+                                GLfloat pen_x,
+                                GLfloat pen_y,
+                                const char *text,
+                                int length)
+{
+        int i;
+
+        for (i = 0; i < length; i++) {
+                const struct glyph *glyph = font->glyph_map[(unsigned char)text[i]];
+
+                if (glyph) {
+                        q->x0 = pen_x;
+                        q->y0 = pen_y;
+                        q->x1 = pen_x + glyph->width;
+                        q->y1 = pen_y - glyph->height;
+                        q->s0 = glyph->s0;
+                        q->t0 = glyph->t0;
+                        q->s1 = glyph->s1;
+                        q->t1 = glyph->t1;
+                        q++;
+
+                        pen_x += glyph->advance;
+                }
+        }
+
+        return q;
+}
+
+/* Add the lines of a layout to a batch, with the top-left of its box at
+ * a certain position. */
+void text_batch_add_layout(struct text_batch *batch,
+                           int x,
+                           int y,
+                           const struct text_layout *layout)
+{
+        struct font *font = batch->font;
+        struct quad *q;
+        int i;
+
+        /* Make room for every character and an ellipsis up front. */
+        batch->quads = _grow_buffer(batch->quads,
+                                    &batch->max_quads,
+                                    batch->num_quads + (int)strlen(layout->text) + 3,
+                                    sizeof(struct quad));
+        q = &batch->quads[batch->num_quads];
+
+        for (i = 0; i < layout->num_lines; i++) {
+                const struct text_line *line = &layout->lines[i];
+                int line_x = x;
+
+                if (layout->width > 0 && layout->align == TEXT_ALIGN_CENTER) {
+                        line_x += (layout->width - line->width) / 2;
+                } else if (layout->width > 0 && layout->align == TEXT_ALIGN_RIGHT) {
+                        line_x += layout->width - line->width;
+                }
+
+                q = _add_glyphs(font,
+                                q,
+                                (GLfloat)line_x,
+                                (GLfloat)(y - i * (font->height + 1)),
+                                layout->text + line->start,
+                                line->length);
+                if (line->ellipsis) {
+                        q = _add_glyphs(font,
+                                        q,
+                                        (GLfloat)(line_x + line->width + 1),
+                                        (GLfloat)(y - i * (font->height + 1)),
+                                        "...",
+                                        3);
+                }
+        }
+
+        batch->num_quads = (int)(q - batch->quads);
+}
+
+/* Load the OpenGL functions that are not part of OpenGL 1.1. */
+void load_gl_procs(void) {
+#define OP(type, name) _##name = (type)SDL_GL_GetProcAddress(#name);
+        FOR_GL_PROC(OP)
+        FOR_CORE_GL_PROC(OP)
+        FOR_OPTIONAL_GL_PROC(OP)
+        FOR_FRAMEBUFFER_GL_PROC(OP)
+#undef OP
+
+        _have_buffers = _glGenBuffers
+                        && _glDeleteBuffers
+                        && _glBindBuffer
+                        && _glBufferData;
+}
+
+/* Hash the key of a text mesh. */
+static unsigned long _hash_text_mesh_key(const struct font *font,
+                                         int x,
+                                         int y,
+                                         int width,
+                                         int align,
+                                         int max_lines,
+                                         const char *text)
+{
+        unsigned long hash = _hash_text_layout_key(font, width, align, max_lines, text);
+
+        hash = (hash ^ (unsigned long)x) * 16777619UL;
+        hash = (hash ^ (unsigned long)y) * 16777619UL;
+
+        return hash;
+}
+
+/* Find the cached mesh of some text, or the slot that it should use.
+ * Return NULL if every slot it could use is still waiting to be drawn
+ * this frame. */
+static struct text_mesh *_find_text_mesh(struct font *font,
+                                         int x,
+                                         int y,
+                                         int width,
+                                         int align,
+                                         int max_lines,
+                                         const char *text,
+                                         unsigned long hash)
+{
+        struct text_mesh *victim = NULL;
+        int i;
+
+        for (i = 0; i < TEXT_MESH_CACHE_PROBES; i++) {
+                struct text_mesh *mesh;
+
+                mesh = &_text_meshes[(hash + i) % TEXT_MESH_CACHE_SIZE];
+                if (mesh->text
+                    && mesh->hash == hash
+                    && mesh->font == font
+                    && mesh->x == x
+                    && mesh->y == y
+                    && mesh->width == width
+                    && mesh->align == align
+                    && mesh->max_lines == max_lines
+                    && strcmp(mesh->text, text) == 0) {
+                        return mesh;
+                }
+
+                if (!victim
+                    || (victim->text
+                        && (!mesh->text || mesh->last_used < victim->last_used))) {
+                        victim = mesh;
+                }
+        }
+
+        /* Take over the free or least recently used slot, unless a draw
+         * of it is still waiting in the render queue.  Flushing the queue
+         * here would draw the layers of this frame out of order. */
+        if (victim->text && victim->last_used > _flushed_text_mesh_clock) {
+                return NULL;
+        }
+        victim->text = _grow_buffer(victim->text,
+                                    &victim->text_capacity,
+                                    (int)strlen(text) + 1,
+                                    1);
+        strcpy(victim->text, text);
+        victim->font = font;
+        victim->font_generation = font->generation - 1;
+        victim->x = x;
+        victim->y = y;
+        victim->width = width;
+        victim->align = align;
+        victim->max_lines = max_lines;
+        victim->hash = hash;
+
+        return victim;
+}
+
+/* Lay out the text of a mesh and upload it to the mesh's buffer. */
+static void _build_text_mesh(struct text_mesh *mesh) {
+        text_batch_begin(&_text_batch, mesh->font);
+        if (mesh->width > 0 || mesh->max_lines > 0) {
+                text_batch_add_layout(&_text_batch,
+                                      mesh->x,
+                                      mesh->y,
+                                      layout_text(mesh->font,
+                                                  mesh->width,
+                                                  mesh->align,
+                                                  mesh->max_lines,
+                                                  mesh->text));
+        } else {
+                text_batch_add(&_text_batch, mesh->x, mesh->y, mesh->text);
+        }
+
+        if (!mesh->buffer) {
+                _glGenBuffers(1, &mesh->buffer);
+        }
+        _renderer->upload_mesh(mesh->buffer,
+                               _text_batch.quads,
+                               _text_batch.num_quads);
+
+        mesh->num_quads = _text_batch.num_quads;
+        mesh->font_generation = mesh->font->generation;
+}
+
+/* Draw text that rarely changes, wrapped to fit a box with its top-left
+ * at a certain position, from a cached mesh in one draw call.  The mesh
+ * is rebuilt only when the text, box or font changes.  A width and line
+ * limit of 0 leave the text as it is. */
+void draw_text_box(struct font *font,
+                   int x,
+                   int y,
+                   int width,
+                   int align,
+                   int max_lines,
+                   const char *text)
+{
+        struct text_mesh *mesh = NULL;
+
+        if (_have_buffers) {
+                mesh = _find_text_mesh(font,
+                                       x,
+                                       y,
+                                       width,
+                                       align,
+                                       max_lines,
+                                       text,
+                                       _hash_text_mesh_key(font, x, y, width, align, max_lines, text));
+        }
+
+        /* Without a mesh, batch the quads of the text this frame. */
+        if (!mesh) {
+                text_batch_begin(&_text_batch, font);
+                if (width > 0 || max_lines > 0) {
+                        text_batch_add_layout(&_text_batch,
+                                              x,
+                                              y,
+                                              layout_text(font, width, align, max_lines, text));
+                } else {
+                        text_batch_add(&_text_batch, x, y, text);
+                }
+                text_batch_draw(&_text_batch);
+                return;
+        }
+
+        if (mesh->font_generation != font->generation) {
+                _build_text_mesh(mesh);
+        }
+        mesh->last_used = ++_text_mesh_clock;
+
+        if (mesh->num_quads > 0) {
+                draw_mesh(font->texture, mesh->buffer, mesh->num_quads, 0.0f, 0.0f);
+        }
+}
+
+/* Draw text that rarely changes from a cached mesh in one draw call.
+ * The mesh is rebuilt only when the text, position or font changes. */
+void draw_cached_text(struct font *font, int x, int y, const char *text) {
+        draw_text_box(font, x, y, 0, TEXT_ALIGN_LEFT, 0, text);
+}
+
+/* Free the text mesh cache. */
+static void _free_text_meshes(void) {
+        int i;
+
+        for (i = 0; i < TEXT_MESH_CACHE_SIZE; i++) {
+                if (_text_meshes[i].buffer) {
+                        _glDeleteBuffers(1, &_text_meshes[i].buffer);
+                        _text_meshes[i].buffer = 0;
+                }
+                free(_text_meshes[i].text);
+                _text_meshes[i].text = NULL;
+                _text_meshes[i].text_capacity = 0;
+        }
+}
+
+/* Set up an empty tilemap of a certain size. */
+void create_tilemap(struct tilemap *map, int width, int height) {
+        map->width = width;
+        map->height = height;
+        map->chunks_wide = (width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        map->chunks_high = (height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        map->chunks = calloc((size_t)(map->chunks_wide * map->chunks_high),
+                             sizeof *map->chunks);
+        if (!map->chunks) {
+                die("calloc: out of memory\n");
+        }
+        map->edits = 0;
+}
+
+/* Free the chunks of a tilemap and their meshes. */
+void free_tilemap(struct tilemap *map) {
+        int i;
+
+        if (!map->chunks) {
+                return;
+        }
+
+        for (i = 0; i < map->chunks_wide * map->chunks_high; i++) {
+                if (map->chunks[i].buffer) {
+                        _glDeleteBuffers(1, &map->chunks[i].buffer);
+                }
+        }
+        free(map->chunks);
+        map->chunks = NULL;
+}
+
+/* Get the tile at a position of a tilemap. */
+int get_tile(const struct tilemap *map, int x, int y) {
+        const struct chunk *chunk;
+
+        chunk = &map->chunks[(y / CHUNK_SIZE) * map->chunks_wide + x / CHUNK_SIZE];
+
+        return chunk->tiles[y % CHUNK_SIZE][x % CHUNK_SIZE];
+}
+
+/* Set the tile at a position of a tilemap.  Only the chunk holding it
+ * has its mesh built again. */
+void set_tile(struct tilemap *map, int x, int y, int tile) {
+        struct chunk *chunk;
+
+        chunk = &map->chunks[(y / CHUNK_SIZE) * map->chunks_wide + x / CHUNK_SIZE];
+        if (chunk->tiles[y % CHUNK_SIZE][x % CHUNK_SIZE] != tile) {
+                chunk->tiles[y % CHUNK_SIZE][x % CHUNK_SIZE] = (Uint8)tile;
+                chunk->dirty = 1;
+                map->edits++;
+        }
+}
+
+/* Make a tilemap a copy of the tiles of another.  Only the chunks whose
+ * tiles differ have their meshes built again. */
+void copy_tilemap(struct tilemap *map, const struct tilemap *source) {
+        int i;
+
+        if (!map->chunks) {
+                create_tilemap(map, source->width, source->height);
+        }
+
+        for (i = 0; i < map->chunks_wide * map->chunks_high; i++) {
+                if (memcmp(map->chunks[i].tiles, source->chunks[i].tiles, sizeof map->chunks[i].tiles) != 0) {
+                        memcpy(map->chunks[i].tiles, source->chunks[i].tiles, sizeof map->chunks[i].tiles);
+                        map->chunks[i].dirty = 1;
+                }
+        }
+        map->edits++;
+}
+
+/* Make the changes waiting in a queue of tile edits to a tilemap. */
+void apply_tile_edits(struct tilemap *map, struct queue *tile_edits) {
+        struct tile_edit edit;
+
+        while (pop_queue(tile_edits, &edit)) {
+                set_tile(map, edit.x, edit.y, edit.tile);
+        }
+}
+
+/* Lay out the tiles of a chunk as quads, with the top-left of the chunk
+ * at a position, and return how many there are. */
+static int _build_chunk_quads(const struct chunk *chunk,
+                              GLfloat x,
+                              GLfloat y,
+                              struct quad *quads)
+{
+        int num_tiles = _tiles_sprite.width / TILE_SIZE;
+        GLfloat tile_width = (_tiles_sprite.s1 - _tiles_sprite.s0) / (GLfloat)num_tiles;
+        struct quad *q = quads;
+        int row;
+        int column;
+
+        for (row = 0; row < CHUNK_SIZE; row++) {
+                for (column = 0; column < CHUNK_SIZE; column++) {
+                        int tile = chunk->tiles[row][column];
+
+                        /* Blank tiles show the background. */
+                        if (tile == TILE_BLANK || tile >= num_tiles) {
+                                continue;
+                        }
+
+                        q->x0 = x + (GLfloat)(column * TILE_SIZE);
+                        q->y0 = y - (GLfloat)(row * TILE_SIZE);
+                        q->x1 = q->x0 + (GLfloat)TILE_SIZE;
+                        q->y1 = q->y0 - (GLfloat)TILE_SIZE;
+                        q->s0 = _tiles_sprite.s0 + tile_width * (GLfloat)tile;
+                        q->t0 = _tiles_sprite.t0;
+                        q->s1 = q->s0 + tile_width;
+                        q->t1 = _tiles_sprite.t1;
+                        q++;
+                }
+        }
+
+        return (int)(q - quads);
+}
+
+/* Draw the chunks of a tilemap that are in view of a camera, building the
+ * meshes of any whose tiles have changed. */
+void draw_tilemap(struct tilemap *map, int camera_x, int camera_y) {
+        static struct quad quads[CHUNK_SIZE * CHUNK_SIZE];
+        int first_column = camera_x / CHUNK_SIZE;
+        int first_row = camera_y / CHUNK_SIZE;
+        int last_column = (camera_x + WINDOW_WIDTH / TILE_SIZE - 1) / CHUNK_SIZE;
+        int last_row = (camera_y + WINDOW_HEIGHT / TILE_SIZE - 1) / CHUNK_SIZE;
+        int row;
+        int column;
+
+        if (!_tiles_sprite.texture) {
+                return;
+        }
+
+        if (last_column >= map->chunks_wide) {
+                last_column = map->chunks_wide - 1;
+        }
+        if (last_row >= map->chunks_high) {
+                last_row = map->chunks_high - 1;
+        }
+
+        set_render_layer(RENDER_LAYER_WORLD);
+        for (row = first_row; row <= last_row; row++) {
+                for (column = first_column; column <= last_column; column++) {
+                        struct chunk *chunk = &map->chunks[row * map->chunks_wide + column];
+                        GLfloat x = (GLfloat)((column * CHUNK_SIZE - camera_x) * TILE_SIZE);
+                        GLfloat y = (GLfloat)(WINDOW_HEIGHT - (row * CHUNK_SIZE - camera_y) * TILE_SIZE);
+
+                        /* Without buffers, lay out the chunk every time. */
+                        if (!_have_buffers) {
+                                draw_quads(_tiles_sprite.texture,
+                                           quads,
+                                           _build_chunk_quads(chunk, x, y, quads));
+                                continue;
+                        }
+
+                        if (!chunk->buffer
+                            || chunk->dirty
+                            || chunk->tiles_generation != _tiles_generation) {
+                                if (!chunk->buffer) {
+                                        _glGenBuffers(1, &chunk->buffer);
+                                }
+                                chunk->num_quads = _build_chunk_quads(chunk, 0.0f, 0.0f, quads);
+                                _renderer->upload_mesh(chunk->buffer, quads, chunk->num_quads);
+                                chunk->dirty = 0;
+                                chunk->tiles_generation = _tiles_generation;
+                        }
+                        draw_mesh(_tiles_sprite.texture, chunk->buffer, chunk->num_quads, x, y);
+                }
+        }
+        set_render_layer(RENDER_LAYER_MENU);
+}
+
+/* Bump the generation of a slot so that handles to it no longer find
+ * anything. */
+static void _retire_entity_slot(struct entities *entities, int slot) {
+        entities->generation[slot]++;
+
+        /* Handles are never generation zero, so that none is ENTITY_NONE. */
+        if (entities->generation[slot] == 0) {
+                entities->generation[slot] = 1;
+        }
+}
+
+/* Remove every entity from a store. */
+void clear_entities(struct entities *entities) {
+        int i;
+
+        for (i = 0; i < entities->count; i++) {
+                _retire_entity_slot(entities, entities->slot[i]);
+        }
+        entities->count = 0;
+
+        /* Hand the slots out from the lowest up. */
+        for (i = 0; i < MAX_ENTITIES; i++) {
+                entities->free_slots[i] = (Uint16)(MAX_ENTITIES - 1 - i);
+        }
+        entities->num_free_slots = MAX_ENTITIES;
+}
+
+/* Set up an empty entity store with room for MAX_ENTITIES. */
+void create_entities(struct entities *entities) {
+        int i;
+
+#define OP(type, name) \
+        entities->name = malloc(MAX_ENTITIES * sizeof *entities->name); \
+        if (!entities->name) { \
+                die("malloc: out of memory\n"); \
+        }
+        FOR_ENTITY_COMPONENT(OP)
+        OP(Uint16, index)
+        OP(Uint16, generation)
+        OP(Uint16, free_slots)
+#undef OP
+
+        for (i = 0; i < MAX_ENTITIES; i++) {
+                entities->generation[i] = 1;
+        }
+        entities->count = 0;
+        entities->num_slots = 0;
+        clear_entities(entities);
+}
+
+/* Free the arrays of an entity store. */
+void free_entities(struct entities *entities) {
+#define OP(type, name) free(entities->name); entities->name = NULL;
+        FOR_ENTITY_COMPONENT(OP)
+        OP(Uint16, index)
+        OP(Uint16, generation)
+        OP(Uint16, free_slots)
+#undef OP
+        entities->count = 0;
+}
+
+/* Add an entity standing still at a position, and return its handle, or
+ * ENTITY_NONE if the store is full. */
+Uint32 spawn_entity(struct entities *entities,
+                    GLfloat x,
+                    GLfloat y,
+                    int sprite,
+                    const struct stats *stats)
+{
+        int i = entities->count;
+        int slot;
+
+        if (entities->num_free_slots == 0) {
+                return ENTITY_NONE;
+        }
+        slot = entities->free_slots[--entities->num_free_slots];
+        if (slot >= entities->num_slots) {
+                entities->num_slots = slot + 1;
+        }
+
+        entities->x[i] = x;
+        entities->y[i] = y;
+        entities->previous_x[i] = x;
+        entities->previous_y[i] = y;
+        entities->velocity_x[i] = 0.0f;
+        entities->velocity_y[i] = 0.0f;
+        entities->sprite[i] = (Uint8)sprite;
+        entities->health[i] = stats->health;
+        entities->might[i] = stats->might;
+        entities->agility[i] = stats->agility;
+        entities->wits[i] = stats->wits;
+        entities->slot[i] = (Uint16)slot;
+        entities->index[slot] = (Uint16)i;
+        entities->count++;
+
+        return (Uint32)entities->generation[slot] << 16 | (Uint32)slot;
+}
+
+/* Find the index of the entity with a handle, or -1 if it is gone. */
+int find_entity(const struct entities *entities, Uint32 handle) {
+        int slot = (int)(handle & 0xffff);
+
+        if (entities->generation[slot] != handle >> 16) {
+                return -1;
+        }
+
+        return entities->index[slot];
+}
+
+/* Remove the entity with a handle, moving the last entity into its place
+ * so that the arrays stay packed. */
+void remove_entity(struct entities *entities, Uint32 handle) {
+        int i = find_entity(entities, handle);
+        int last = entities->count - 1;
+
+        if (i < 0) {
+                return;
+        }
+
+        _retire_entity_slot(entities, entities->slot[i]);
+        entities->free_slots[entities->num_free_slots++] = entities->slot[i];
+#define OP(type, name) entities->name[i] = entities->name[last];
+        FOR_ENTITY_COMPONENT(OP)
+#undef OP
+        entities->index[entities->slot[i]] = (Uint16)i;
+        entities->count--;
+}
+
+/* Whether updating a store would change any entity of it: whether any
+ * has somewhere to go, or has yet to catch up with where it was one tick
+ * ago */
+static int _entities_are_moving(const struct entities *entities) {
+        int moving = 0;
+        int i;
+
+        for (i = 0; i < entities->count; i++) {
+                moving |= (entities->velocity_x[i] != 0.0f) | (entities->velocity_y[i] != 0.0f)
+                          | (entities->previous_x[i] != entities->x[i])
+                          | (entities->previous_y[i] != entities->y[i]);
+        }
+
+        return moving;
+}
+
+/* Move every entity of a store by its velocity, turning back at the walls
+ * of a tilemap.  The loops have no calls or branches, so that the
+ * compiler can vectorize them. */
+void update_entities(struct entities *entities, const struct tilemap *map) {
+        GLfloat *x = entities->x;
+        GLfloat *y = entities->y;
+        GLfloat *velocity_x = entities->velocity_x;
+        GLfloat *velocity_y = entities->velocity_y;
+        GLfloat max_x = (GLfloat)(map->width - 2);
+        GLfloat max_y = (GLfloat)(map->height - 2);
+        int count = entities->count;
+        int i;
+
+        memcpy(entities->previous_x, x, (size_t)count * sizeof *x);
+        memcpy(entities->previous_y, y, (size_t)count * sizeof *y);
+
+        for (i = 0; i < count; i++) {
+                x[i] += velocity_x[i];
+                y[i] += velocity_y[i];
+        }
+
+        for (i = 0; i < count; i++) {
+                int turn_x = ((x[i] < 1.0f) & (velocity_x[i] < 0.0f))
+                             | ((x[i] > max_x) & (velocity_x[i] > 0.0f));
+                int turn_y = ((y[i] < 1.0f) & (velocity_y[i] < 0.0f))
+                             | ((y[i] > max_y) & (velocity_y[i] > 0.0f));
+
+                velocity_x[i] = turn_x ? -velocity_x[i] : velocity_x[i];
+                velocity_y[i] = turn_y ? -velocity_y[i] : velocity_y[i];
+        }
+}
+
+/* Draw the entities in view of a camera, placed between where they were
+ * at the last two ticks, with one draw for each kind of sprite. */
+void draw_entities(const struct entities *entities,
+                   int camera_x,
+                   int camera_y,
+                   GLfloat alpha)
+{
+        struct quad *quads;
+        int kind;
+
+        /* Make room for every entity to be in view. */
+        quads = arena_alloc(&_frame_arena, (size_t)entities->count * sizeof *quads);
+
+        set_render_layer(RENDER_LAYER_ENTITIES);
+        for (kind = 0; kind < NUM_ENTITY_SPRITES; kind++) {
+                const struct sprite *sprite = _entity_sprites[kind];
+                int num_quads = 0;
+                int i;
+
+                if (!sprite->texture) {
+                        continue;
+                }
+
+                for (i = 0; i < entities->count; i++) {
+                        GLfloat x;
+                        GLfloat y;
+                        struct quad *q;
+
+                        if (entities->sprite[i] != kind) {
+                                continue;
+                        }
+
+                        x = entities->previous_x[i]
+                            + (entities->x[i] - entities->previous_x[i]) * alpha;
+                        y = entities->previous_y[i]
+                            + (entities->y[i] - entities->previous_y[i]) * alpha;
+                        x = (x - (GLfloat)camera_x) * (GLfloat)TILE_SIZE;
+                        y = (GLfloat)WINDOW_HEIGHT - (y - (GLfloat)camera_y) * (GLfloat)TILE_SIZE;
+                        if (x + (GLfloat)sprite->width <= 0.0f
+                            || x >= (GLfloat)WINDOW_WIDTH
+                            || y <= 0.0f
+                            || y - (GLfloat)sprite->height >= (GLfloat)WINDOW_HEIGHT) {
+                                continue;
+                        }
+
+                        q = &quads[num_quads++];
+
+                        /* Snap to whole pixels. */
+                        q->x0 = (GLfloat)(int)(x + 0.5f);
+                        q->y0 = (GLfloat)(int)(y + 0.5f);
+                        q->x1 = q->x0 + (GLfloat)sprite->width;
+                        q->y1 = q->y0 - (GLfloat)sprite->height;
+                        q->s0 = sprite->s0;
+                        q->t0 = sprite->t0;
+                        q->s1 = sprite->s1;
+                        q->t1 = sprite->t1;
+                }
+
+                draw_quads(sprite->texture, quads, num_quads);
+        }
+        set_render_layer(RENDER_LAYER_MENU);
+}
+
+/* Create an OpenGL texture from RGB pixels. */
+GLuint create_gl_texture(int width, int height, const void *pixels) {
+        GLuint tex;
+
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     GL_RGB8,
+                     width,
+                     height,
+                     0,
+                     GL_RGB,
+                     GL_UNSIGNED_BYTE,
+                     pixels);
+
+        return tex;
+}
+
+/* Free the framebuffer that the scene is drawn into. */
+void free_scene_framebuffer(void) {
+        if (_scene_framebuffer) {
+                _glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                _glDeleteFramebuffers(1, &_scene_framebuffer);
+                _scene_framebuffer = 0;
+        }
+        if (_scene_texture) {
+                glDeleteTextures(1, &_scene_texture);
+                _scene_texture = 0;
+        }
+}
+
+/* Set up a framebuffer to draw the scene into at the size of the game,
+ * if the driver has framebuffer objects.  Without one, the scene is drawn
+ * straight to the window. */
+void create_scene_framebuffer(void) {
+#define OP(type, name) if (!_##name) { return; }
+        FOR_FRAMEBUFFER_GL_PROC(OP)
+#undef OP
+        if (!_renderer->core_profile
+            && !SDL_GL_ExtensionSupported("GL_ARB_framebuffer_object")) {
+                return;
+        }
+
+        _scene_texture = create_gl_texture(WINDOW_WIDTH, WINDOW_HEIGHT, NULL);
+        _glGenFramebuffers(1, &_scene_framebuffer);
+        _glBindFramebuffer(GL_FRAMEBUFFER, _scene_framebuffer);
+        _glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                GL_COLOR_ATTACHMENT0,
+                                GL_TEXTURE_2D,
+                                _scene_texture,
+                                0);
+        if (_glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                fprintf(stderr, "lambhorn: cannot draw to a framebuffer\n");
+                free_scene_framebuffer();
+        }
+}
+
+/* Place the scene in the middle of the window, scaled up by the largest
+ * whole number that fits, or scaled down to fit a window smaller than the
+ * game. */
+static void _place_scene(void) {
+        int scale;
+
+        SDL_GL_GetDrawableSize(_window, &_drawable_width, &_drawable_height);
+        scale = _drawable_width / WINDOW_WIDTH;
+        if (_drawable_height / WINDOW_HEIGHT < scale) {
+                scale = _drawable_height / WINDOW_HEIGHT;
+        }
+
+        if (scale >= 1) {
+                _scene_rect.w = WINDOW_WIDTH * scale;
+                _scene_rect.h = WINDOW_HEIGHT * scale;
+        } else if (_drawable_width * WINDOW_HEIGHT < _drawable_height * WINDOW_WIDTH) {
+                _scene_rect.w = _drawable_width;
+                _scene_rect.h = _drawable_width * WINDOW_HEIGHT / WINDOW_WIDTH;
+        } else {
+                _scene_rect.w = _drawable_height * WINDOW_WIDTH / WINDOW_HEIGHT;
+                _scene_rect.h = _drawable_height;
+        }
+        _scene_rect.x = (_drawable_width - _scene_rect.w) / 2;
+        _scene_rect.y = (_drawable_height - _scene_rect.h) / 2;
+}
+
+/* Start drawing a frame of the scene, clearing it. */
+void begin_scene(void) {
+        if (_scene_framebuffer) {
+                _glBindFramebuffer(GL_FRAMEBUFFER, _scene_framebuffer);
+                glViewport(0, 0, (GLsizei)WINDOW_WIDTH, (GLsizei)WINDOW_HEIGHT);
+        } else {
+                _place_scene();
+                glViewport(_scene_rect.x,
+                           _scene_rect.y,
+                           (GLsizei)_scene_rect.w,
+                           (GLsizei)_scene_rect.h);
+        }
+        glClear(GL_COLOR_BUFFER_BIT);
+}
+
+/* Copy the scene to the window in one nearest-neighbour blit, so that it
+ * costs the same to draw whatever the size of the window. */
+void present_scene(void) {
+        if (!_scene_framebuffer) {
+                return;
+        }
+
+        _place_scene();
+        _glBindFramebuffer(GL_READ_FRAMEBUFFER, _scene_framebuffer);
+        _glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+        /* Clear the borders around the scene. */
+        if (_scene_rect.w != _drawable_width || _scene_rect.h != _drawable_height) {
+                glClear(GL_COLOR_BUFFER_BIT);
+        }
+
+        _glBlitFramebuffer(0,
+                           0,
+                           WINDOW_WIDTH,
+                           WINDOW_HEIGHT,
+                           _scene_rect.x,
+                           _scene_rect.y,
+                           _scene_rect.x + _scene_rect.w,
+                           _scene_rect.y + _scene_rect.h,
+                           GL_COLOR_BUFFER_BIT,
+                           GL_NEAREST);
+}
+
+/* Unmap an asset pack. */
+void close_pack(struct pack *pack) {
+        if (pack->data) {
+                munmap((void *)pack->data, pack->size);
+        }
+
+        pack->data = NULL;
+        pack->size = 0;
+        pack->header = NULL;
+        pack->entries = NULL;
+}
+
+/* Map an asset pack into memory and check its table of entries. */
+int open_pack(struct pack *pack,
+              const char *path,
+              void (*print_error)(const char*, ...)) {
+        struct stat st;
+        void *data;
+        int fd;
+        Uint32 i;
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                print_error("open: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        if (fstat(fd, &st) == -1) {
+                close(fd);
+                print_error("fstat: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        if ((size_t)st.st_size < sizeof(struct pack_header)) {
+                close(fd);
+                print_error("%s: not an asset pack\n", path);
+                return 0;
+        }
+
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                print_error("mmap: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        pack->data = data;
+        pack->size = (size_t)st.st_size;
+        pack->header = data;
+        pack->entries = (const struct pack_entry *)(pack->header + 1);
+
+        if (memcmp(pack->header->magic, PACK_MAGIC, sizeof PACK_MAGIC) != 0
+            || pack->header->version != PACK_VERSION
+            || pack->header->num_entries
+               > (pack->size - sizeof(struct pack_header))
+                 / sizeof(struct pack_entry)) {
+                close_pack(pack);
+                print_error("%s: not an asset pack\n", path);
+                return 0;
+        }
+
+        /* Check sizes in 64 bits, so that the size of a corrupt entry
+         * cannot wrap around to match. */
+        for (i = 0; i < pack->header->num_entries; i++) {
+                const struct pack_entry *entry = &pack->entries[i];
+
+                if ((Uint64)entry->offset + entry->size > (Uint64)pack->size
+                    || entry->format != PACK_FORMAT_RGB8
+                    || (Uint64)entry->size != (Uint64)entry->width * entry->height * 3
+                    || entry->name[PACK_NAME_SIZE - 1] != '\0') {
+                        close_pack(pack);
+                        print_error("%s: corrupt asset pack\n", path);
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+/* Find an entry in an asset pack by name. */
+const struct pack_entry *find_pack_entry(const struct pack *pack,
+                                         const char *name) {
+        Uint32 i;
+
+        for (i = 0; i < pack->header->num_entries; i++) {
+                if (strcmp(pack->entries[i].name, name) == 0) {
+                        return &pack->entries[i];
+                }
+        }
+
+        return NULL;
+}
+
+/* Load an OpenGL texture straight from the pixels in an asset pack. */
+GLuint load_gl_texture_from_pack(const struct pack *pack,
+                                 const char *name,
+                                 void (*print_error)(const char*, ...)) {
+        const struct pack_entry *entry;
+        GLuint tex;
+
+        entry = find_pack_entry(pack, name);
+        if (!entry) {
+                print_error("asset pack: no entry named %s\n", name);
+                return 0;
+        }
+
+        /* Pack rows are not padded. */
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        tex = create_gl_texture((int)entry->width,
+                                (int)entry->height,
+                                pack->data + entry->offset);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        return tex;
+}
+
+/* Decode the image of a job and convert it to RGB. */
+static void _decode_asset_job(struct asset_job *job) {
+        job->surf = IMG_Load(job->path);
+        if (!job->surf) {
+                SDL_snprintf(job->error, sizeof job->error,
+                             "IMG_Load: %s\n", IMG_GetError());
+                return;
+        }
+
+        job->converted = SDL_ConvertSurfaceFormat(job->surf,
+                                                  SDL_PIXELFORMAT_RGB24,
+                                                  0);
+        if (!job->converted) {
+                SDL_snprintf(job->error, sizeof job->error,
+                             "SDL_ConvertSurfaceFormat: %s\n", SDL_GetError());
+                return;
+        }
+
+        job->pixels = job->converted->pixels;
+        job->width = job->converted->w;
+        job->height = job->converted->h;
+        job->pitch = job->converted->pitch;
+}
+
+/* Push a job onto the stack of decoded jobs. */
+static void _push_ready_asset_job(struct asset_job *job) {
+        void *head;
+
+        do {
+                head = SDL_AtomicGetPtr(&_asset_ready);
+                job->next = head;
+        } while (!SDL_AtomicCASPtr(&_asset_ready, head, job));
+}
+
+/* Decode requested images until there are no more requests. */
+static int _run_asset_worker(void *data) {
+        USED(data);
+
+        while (1) {
+                struct asset_job *job;
+
+                SDL_SemWait(_asset_requested);
+
+                SDL_LockMutex(_asset_lock);
+                job = _asset_requests;
+                if (job) {
+                        _asset_requests = job->next;
+                        if (!_asset_requests) {
+                                _asset_requests_tail = &_asset_requests;
+                        }
+                }
+                SDL_UnlockMutex(_asset_lock);
+
+                /* A wake-up without a job means that it is time to stop. */
+                if (!job) {
+                        return 0;
+                }
+
+                _decode_asset_job(job);
+                _push_ready_asset_job(job);
+        }
+}
+
+/* Start the threads that decode images. */
+void start_asset_loader(void) {
+        int i;
+
+        _asset_lock = SDL_CreateMutex();
+        if (!_asset_lock) {
+                die("SDL_CreateMutex: %s\n", SDL_GetError());
+        }
+        _asset_requested = SDL_CreateSemaphore(0);
+        if (!_asset_requested) {
+                die("SDL_CreateSemaphore: %s\n", SDL_GetError());
+        }
+        create_pool(&_asset_job_pool, MAX_ASSET_JOBS, sizeof(struct asset_job));
+
+        _num_asset_workers = SDL_GetCPUCount() - 1;
+        if (_num_asset_workers < 1) {
+                _num_asset_workers = 1;
+        } else if (_num_asset_workers > MAX_ASSET_WORKERS) {
+                _num_asset_workers = MAX_ASSET_WORKERS;
+        }
+
+        for (i = 0; i < _num_asset_workers; i++) {
+                _asset_workers[i] = SDL_CreateThread(&_run_asset_worker,
+                                                     "asset worker",
+                                                     NULL);
+                if (!_asset_workers[i]) {
+                        _num_asset_workers = i;
+                        die("SDL_CreateThread: %s\n", SDL_GetError());
+                }
+        }
+}
+
+/* Free a job and anything it still holds. */
+static void _free_asset_job(struct asset_job *job) {
+        if (job->pending_texture) {
+                glDeleteTextures(1, &job->pending_texture);
+        }
+        SDL_FreeSurface(job->converted);
+        SDL_FreeSurface(job->surf);
+        pool_free(&_asset_job_pool, job);
+}
+
+/* Free a list of jobs. */
+static void _free_asset_jobs(struct asset_job *job) {
+        while (job) {
+                struct asset_job *next = job->next;
+
+                _free_asset_job(job);
+                job = next;
+        }
+}
+
+/* Stop the threads that decode images and drop any unfinished jobs. */
+void stop_asset_loader(void) {
+        int i;
+
+        if (!_asset_lock) {
+                return;
+        }
+
+        SDL_LockMutex(_asset_lock);
+        _free_asset_jobs(_asset_requests);
+        _asset_requests = NULL;
+        _asset_requests_tail = &_asset_requests;
+        SDL_UnlockMutex(_asset_lock);
+
+        for (i = 0; i < _num_asset_workers; i++) {
+                SDL_SemPost(_asset_requested);
+        }
+        for (i = 0; i < _num_asset_workers; i++) {
+                SDL_WaitThread(_asset_workers[i], NULL);
+        }
+        _num_asset_workers = 0;
+
+        _free_asset_jobs(SDL_AtomicSetPtr(&_asset_ready, NULL));
+        _free_asset_jobs(_asset_uploads);
+        _asset_uploads = NULL;
+        _num_asset_jobs = 0;
+
+        SDL_DestroySemaphore(_asset_requested);
+        SDL_DestroyMutex(_asset_lock);
+        _asset_requested = NULL;
+        _asset_lock = NULL;
+        free_pool(&_asset_job_pool);
+}
+
+/* Make a new job for loading a texture. */
+static struct asset_job *_new_asset_job(GLuint *texture,
+                                        void (*surface_handler)(SDL_Surface*, void*),
+                                        void *data) {
+        struct asset_job *job = pool_alloc(&_asset_job_pool);
+
+        if (!job) {
+                die("lambhorn: too many images loading at once\n");
+        }
+
+        job->texture = texture;
+        job->surface_handler = surface_handler;
+        job->data = data;
+        _num_asset_jobs++;
+
+        return job;
+}
+
+/* Hand a job to the threads that decode images. */
+static void _request_asset_job(struct asset_job *job) {
+        SDL_LockMutex(_asset_lock);
+        *_asset_requests_tail = job;
+        _asset_requests_tail = &job->next;
+        SDL_UnlockMutex(_asset_lock);
+        SDL_SemPost(_asset_requested);
+}
+
+/* Load an OpenGL texture from a file in the background.  The texture is
+ * set and the surface handler is called on the main thread once the
+ * whole image has been uploaded. */
+void load_gl_texture_async(const char *path,
+                           GLuint *texture,
+                           void (*surface_handler)(SDL_Surface*, void*),
+                           void *data) {
+        struct asset_job *job = _new_asset_job(texture, surface_handler, data);
+
+        job->path = path;
+        _request_asset_job(job);
+}
+
+/* Load an OpenGL texture from a file in the background again, to take
+ * the place of the one that is there.  The old texture is deleted once
+ * the new one has been uploaded.  If the image cannot be loaded, the old
+ * texture stays and the surface handler is called without a surface. */
+void reload_gl_texture_async(const char *path,
+                             GLuint *texture,
+                             void (*surface_handler)(SDL_Surface*, void*),
+                             void *data) {
+        struct asset_job *job = _new_asset_job(texture, surface_handler, data);
+
+        job->path = path;
+        job->reload = 1;
+        _request_asset_job(job);
+}
+
+/* Load an OpenGL texture from an asset pack in the background.  There
+ * is nothing to decode, so the pixels go straight to the upload queue,
+ * and the surface handler is called without a surface. */
+void load_gl_texture_from_pack_async(const struct pack *pack,
+                                     const char *name,
+                                     GLuint *texture,
+                                     void (*surface_handler)(SDL_Surface*, void*),
+                                     void *data,
+                                     void (*print_error)(const char*, ...)) {
+        const struct pack_entry *entry;
+        struct asset_job *job;
+
+        entry = find_pack_entry(pack, name);
+        if (!entry) {
+                print_error("asset pack: no entry named %s\n", name);
+                return;
+        }
+
+        job = _new_asset_job(texture, surface_handler, data);
+        job->pixels = pack->data + entry->offset;
+        job->width = (int)entry->width;
+        job->height = (int)entry->height;
+        job->pitch = (int)entry->width * 3;
+        _push_ready_asset_job(job);
+}
+
+/* Upload some rows of the image of a job to its texture. */
+static void _upload_asset_rows(struct asset_job *job, int num_rows) {
+        if (!job->pending_texture) {
+                job->pending_texture = create_gl_texture(job->width,
+                                                         job->height,
+                                                         NULL);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, job->pending_texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, job->pitch == job->width * 3 ? 1 : 4);
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,
+                        0,
+                        job->uploaded_rows,
+                        job->width,
+                        num_rows,
+                        GL_RGB,
+                        GL_UNSIGNED_BYTE,
+                        job->pixels + job->pitch * job->uploaded_rows);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        job->uploaded_rows += num_rows;
+}
+
+/* Upload the decoded images, spending at most a certain number of bytes,
+ * and return the number of jobs that are not finished yet. */
+int update_asset_loader(long budget, void (*print_error)(const char*, ...)) {
+        struct asset_job *ready;
+
+        /* Move newly decoded jobs to the end of the upload queue,
+         * undoing the order of the stack. */
+        ready = SDL_AtomicSetPtr(&_asset_ready, NULL);
+        if (ready) {
+                struct asset_job *reversed = NULL;
+                struct asset_job **tail = &_asset_uploads;
+
+                while (ready) {
+                        struct asset_job *next = ready->next;
+
+                        ready->next = reversed;
+                        reversed = ready;
+                        ready = next;
+                }
+
+                while (*tail) {
+                        tail = &(*tail)->next;
+                }
+                *tail = reversed;
+        }
+
+        while (_asset_uploads && budget > 0) {
+                struct asset_job *job = _asset_uploads;
+                long row_size = (long)job->width * 3;
+                long num_rows;
+
+                if (job->error[0] != '\0') {
+                        /* An image being changed may be half written, so
+                         * failing to reload it is not fatal. */
+                        if (job->reload) {
+                                fprintf(stderr, "lambhorn: %s: %s", job->path, job->error);
+                                if (job->surface_handler) {
+                                        job->surface_handler(NULL, job->data);
+                                }
+                        } else {
+                                print_error("%s", job->error);
+                        }
+                        _asset_uploads = job->next;
+                        _free_asset_job(job);
+                        _num_asset_jobs--;
+                        continue;
+                }
+
+                /* Upload at least one row so that every job finishes. */
+                num_rows = row_size > 0 ? budget / row_size : job->height;
+                if (num_rows < 1) {
+                        num_rows = 1;
+                }
+                if (num_rows > job->height - job->uploaded_rows) {
+                        num_rows = job->height - job->uploaded_rows;
+                }
+
+                _upload_asset_rows(job, (int)num_rows);
+                budget -= num_rows * row_size;
+
+                if (job->uploaded_rows == job->height) {
+                        _asset_uploads = job->next;
+                        if (job->reload) {
+                                glDeleteTextures(1, job->texture);
+                        }
+                        *job->texture = job->pending_texture;
+                        job->pending_texture = 0;
+                        if (job->surface_handler) {
+                                job->surface_handler(job->surf, job->data);
+                        }
+                        _free_asset_job(job);
+                        _num_asset_jobs--;
+                }
+        }
+
+        return _num_asset_jobs;
+}
+
+/* Start timing a section of a frame. */
+Uint64 profile_begin(void) {
+        return _profiling ? SDL_GetPerformanceCounter() : 0;
+}
+
+/* Record a section of a frame timed on some thread.  Only the render
+ * thread may record, so other threads hand their timings to it. */
+void profile_record(int section, int thread, Uint64 start, Uint64 end) {
+        struct profile_event *event;
+
+        if (!_profiling) {
+                return;
+        }
+
+        event = &_profile_events[_num_profile_events++ % PROFILE_RING_SIZE];
+        event->section = section;
+        event->thread = thread;
+        event->start = start;
+        event->end = end;
+        _profile_history[_profile_frame][section] += end - start;
+}
+
+/* Stop timing a section of a frame and record it. */
+void profile_end(int section, Uint64 start) {
+        if (!_profiling) {
+                return;
+        }
+
+        profile_record(section, PROFILE_THREAD_RENDER, start, SDL_GetPerformanceCounter());
+}
+
+/* Start recording the sections of the next frame. */
+void profile_next_frame(void) {
+        _profile_frame = (_profile_frame + 1) % PROFILE_HISTORY;
+        memset(_profile_history[_profile_frame], 0, sizeof *_profile_history);
+}
+
+/* Draw the average time spent in each section as a labelled bar, and
+ * what the last frame allocated under them. */
+void draw_profile_overlay(void) {
+#define OP(id, name) name,
+        static const char *names[] = {FOR_PROFILE_SECTION(OP)};
+#undef OP
+        double frequency = (double)SDL_GetPerformanceFrequency();
+        int line_height = _font.height + 1;
+        struct quad bars[NUM_PROFILE_ROWS];
+        int i;
+
+        if (!_font.texture) {
+                return;
+        }
+
+        set_render_layer(RENDER_LAYER_OVERLAY);
+
+        /* Draw the labels in one batch. */
+        text_batch_begin(&_text_batch, &_font);
+        for (i = 0; i < NUM_PROFILE_SECTIONS; i++) {
+                text_batch_add(&_text_batch,
+                               9,
+                               5 + line_height * (NUM_PROFILE_ROWS - i),
+                               names[i]);
+        }
+        text_batch_add(&_text_batch, 9, 5 + line_height * 2, "arena");
+        text_batch_add(&_text_batch, 9, 5 + line_height, "heap");
+        text_batch_draw(&_text_batch);
+
+        /* Draw the bars in one batch, leaving out the frame being
+         * recorded. */
+        for (i = 0; i < NUM_PROFILE_ROWS; i++) {
+                Uint64 total = 0;
+                double milliseconds;
+                int length;
+                int frame;
+                int y = 5 + line_height * (NUM_PROFILE_ROWS - i);
+
+                if (i == NUM_PROFILE_SECTIONS) {
+                        length = (int)(_frame_arena.last_used
+                                       / PROFILE_ARENA_BAR_SCALE);
+                } else if (i == NUM_PROFILE_SECTIONS + 1) {
+                        length = (int)_frame_heap_allocations
+                                 * PROFILE_HEAP_BAR_SCALE;
+                } else {
+                        for (frame = 0; frame < PROFILE_HISTORY; frame++) {
+                                if (frame != _profile_frame) {
+                                        total += _profile_history[frame][i];
+                                }
+                        }
+                        milliseconds = (double)total * 1000.0 / frequency
+                                       / (double)(PROFILE_HISTORY - 1);
+                        length = (int)(milliseconds * PROFILE_BAR_SCALE);
+                }
+
+                bars[i].x0 = 100.0f;
+                bars[i].y0 = (GLfloat)(y - 2);
+                bars[i].x1 = (GLfloat)(100 + 1 + length);
+                bars[i].y1 = (GLfloat)(y - line_height + 2);
+                bars[i].s0 = 0.5f;
+                bars[i].t0 = 0.5f;
+                bars[i].s1 = 0.5f;
+                bars[i].t1 = 0.5f;
+        }
+        draw_quads(_solid_texture, bars, NUM_PROFILE_ROWS);
+
+        set_render_layer(RENDER_LAYER_MENU);
+}
+
+/* Write the recorded profile events as a Chrome trace. */
+static void _write_trace(void) {
+#define OP(id, name) name,
+        static const char *names[] = {FOR_PROFILE_SECTION(OP)};
+#undef OP
+        double frequency = (double)SDL_GetPerformanceFrequency();
+        unsigned long first = 0;
+        unsigned long n;
+        FILE *out;
+
+        out = fopen(_trace_path, "w");
+        if (!out) {
+                fprintf(stderr, "lambhorn: cannot write %s\n", _trace_path);
+                return;
+        }
+
+        if (_num_profile_events > PROFILE_RING_SIZE) {
+                first = _num_profile_events - PROFILE_RING_SIZE;
+        }
+
+        fprintf(out, "{\"traceEvents\":[\n");
+        for (n = first; n < _num_profile_events; n++) {
+                const struct profile_event *event = &_profile_events[n % PROFILE_RING_SIZE];
+
+                fprintf(out,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                        names[event->section],
+                        event->thread,
+                        (double)(event->start - _profile_start) * 1000000.0 / frequency,
+                        (double)(event->end - event->start) * 1000000.0 / frequency,
+                        n + 1 < _num_profile_events ? "," : "");
+        }
+        fprintf(out, "],\"displayTimeUnit\":\"ms\"}\n");
+
+        if (fclose(out) != 0) {
+                fprintf(stderr, "lambhorn: cannot write %s\n", _trace_path);
+        }
+}
+
+/* Print how many frames were drawn, to check that an idle game is not
+ * drawing at all. */
+static void _print_frame_stats(void) {
+        double seconds = (double)(SDL_GetTicks() - _start_ticks) / 1000.0;
+
+        fprintf(stderr,
+                "lambhorn: drew %lu frames in %.1f seconds (%.2f per second)\n",
+                _frames_drawn,
+                seconds,
+                seconds > 0.0 ? (double)_frames_drawn / seconds : 0.0);
+        fprintf(stderr,
+                "lambhorn: the frame arena peaked at %lu bytes, "
+                "and the last frame made %lu allocations from it\n",
+                (unsigned long)_frame_arena.peak,
+                _frame_arena.last_allocations);
+        fprintf(stderr,
+                "lambhorn: %lu heap allocations while drawing, the last in frame %lu\n",
+                _drawing_heap_allocations,
+                _last_allocating_frame);
+        fprintf(stderr, "lambhorn: wrapped text %lu times\n", _text_layouts_built);
+}
+
+/* Clean up any used memory. */
+static void _clean_up(void) {
+        stop_asset_loader();
+        close_pack(&_pack);
+        _free_text_meshes();
+        _free_text_layouts();
+        text_batch_free(&_text_batch);
+        _free_render_queue();
+        free_tilemap(&_world);
+        free_entities(&_entities);
+        free_arena(&_frame_arena);
+
+        if (glIsTexture(_font.texture)) {
+                glDeleteTextures(1, &_font.texture);
+        }
+
+        if (glIsTexture(_cursor_sprite.texture)) {
+                glDeleteTextures(1, &_cursor_sprite.texture);
+        }
+
+        if (glIsTexture(_tiles_sprite.texture)) {
+                glDeleteTextures(1, &_tiles_sprite.texture);
+        }
+
+        if (glIsTexture(_lamb_sprite.texture)) {
+                glDeleteTextures(1, &_lamb_sprite.texture);
+        }
+
+        if (glIsTexture(_solid_texture)) {
+                glDeleteTextures(1, &_solid_texture);
+        }
+
+        if (_context) {
+                free_scene_framebuffer();
+        }
+
+        if (_renderer) {
+                _renderer->quit();
+        }
+
+        if (_context) {
+                SDL_GL_DeleteContext(_context);
+        }
+
+        if (_window) {
+                SDL_DestroyWindow(_window);
+        }
+}
+
+/* Load an OpenGL texture from a file. */
+GLuint load_gl_texture_and_handle_surface(
+                const char *path,
+                void (*surface_handler)(SDL_Surface*, void*),
+                void *data,
+                void (*print_error)(const char*, ...)) {
+        SDL_Surface *surf;
+        SDL_Surface *converted;
+        GLuint tex;
+
+        /* Load the image. */
+        surf = IMG_Load(path);
+        if (!surf) {
+                print_error("IMG_Load: %s\n", IMG_GetError());
+                return 0;
+        }
+
+        /* Convert the surface to a format that OpenGL can parse. */
+        converted = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
+        if (!converted) {
+                SDL_FreeSurface(surf);
+                print_error("SDL_ConvertSurfaceFormat: %s\n", SDL_GetError());
+                return 0;
+        }
+
+        /* Turn the texture into an OpenGL texture. */
+        tex = create_gl_texture(converted->w, converted->h, converted->pixels);
+
+        /* Send the surface to the user-supplied surface handler
+         * for extra processing. */
+        surface_handler(surf, data);
+
+        /* Free the surfaces. */
+        SDL_FreeSurface(converted);
+        SDL_FreeSurface(surf);
+
+        /* Return the loaded texture ID. */
+        return tex;
+}
+
+
+/* Load a texture from a file. */
+SDL_Texture *load_texture_and_handle_surface(
+                SDL_Renderer *renderer,
+                const char *path,
+                void (*surface_handler)(SDL_Surface*, void*),
+                void *data,
+                void (*print_error)(const char*, ...)) {
+        SDL_Surface *surf;
+        SDL_Texture *tex;
+
+        surf = IMG_Load(path);
+        if (!surf) {
+                print_error("IMG_Load: %s\n", IMG_GetError());
+                return NULL;
+        }
+
+        tex = SDL_CreateTextureFromSurface(renderer, surf);
+        if (!tex) {
+                const char *error = SDL_GetError();
+                SDL_FreeSurface(surf);
+                print_error("SDL_CreateTextureFromSurface: %s\n", error);
+                return NULL;
+        }
+
+        surface_handler(surf, data);
+        SDL_FreeSurface(surf);
+
+        return tex;
+}
+
+/* Get sprite dimensions from a surface. */
+void get_sprite_dims_from_surface(SDL_Surface *surf, void *sprite_ptr) {
+        struct sprite *sprite = sprite_ptr;
+
+        sprite->width = surf->w;
+        sprite->height = surf->h;
+        sprite->s0 = 0.0f;
+        sprite->t0 = 0.0f;
+        sprite->s1 = 1.0f;
+        sprite->t1 = 1.0f;
+}
+
+/* Compute the glyphs and the glyph map of a font from its clips. */
+void build_font_glyphs(struct font *font) {
+        GLfloat inv_width = 1.0f / (GLfloat)font->image_width;
+        GLfloat inv_height = 1.0f / (GLfloat)font->image_height;
+        int i;
+
+        memset(font->glyph_map, 0, sizeof font->glyph_map);
+
+        for (i = 0; font->alphabet[i] != '\0'; i++) {
+                SDL_Rect *clip = &font->clips[i];
+                struct glyph *glyph = &font->glyphs[i];
+
+                glyph->s0 = (GLfloat)clip->x * inv_width;
+                glyph->t0 = (GLfloat)clip->y * inv_height;
+                glyph->s1 = (GLfloat)(clip->x + clip->w) * inv_width;
+                glyph->t1 = (GLfloat)(clip->y + clip->h) * inv_height;
+                glyph->width = (GLfloat)clip->w;
+                glyph->height = (GLfloat)clip->h;
+                glyph->advance = (GLfloat)(clip->w + 1);
+
+                /* The first glyph for a character wins, as it always has. */
+                if (!font->glyph_map[(unsigned char)font->alphabet[i]]) {
+                        font->glyph_map[(unsigned char)font->alphabet[i]] = glyph;
+                }
+        }
+
+        font->generation++;
+}
+
+/* Get font information (clips & height) from a surface. */
+void get_font_info_from_surface(SDL_Surface *surf, void *font_ptr) {
+        struct font *font = font_ptr;
+        const char *divider_row;
+        int locked = 0;
+        int i;
+        int x;
+
+        font->image_width = surf->w;
+        font->image_height = surf->h;
+
+        /* Lock the surface once for the whole scan. */
+        if (SDL_MUSTLOCK(surf)) {
+                SDL_LockSurface(surf);
+                locked = 1;
+        }
+        divider_row = (const char *)surf->pixels + surf->pitch * (surf->h - 1);
+
+        x = 1;
+        for (i = 0; font->alphabet[i] != '\0'; i++) {
+                int j;
+
+                font->clips[i].x = x;
+                font->clips[i].y = 0;
+
+                font->clips[i].w = 0;
+                for (j = x; j < surf->w; j++) {
+                        if (divider_row[j] == divider_row[0]) {
+                                font->clips[i].w = j - x;
+                                x = j + 1;
+                                break;
+                        }
+                }
+
+                font->clips[i].h = surf->h - 1;
+        }
+
+        if (locked) {
+                SDL_UnlockSurface(surf);
+        }
+
+        font->height = surf->h;
+
+        build_font_glyphs(font);
+}
+
+/* Point a sprite at its rectangle of the baked atlas. */
+static void _set_atlas_sprite(struct sprite *sprite, GLuint texture, SDL_Rect rect) {
+        sprite->texture = texture;
+        sprite->width = rect.w;
+        sprite->height = rect.h;
+        sprite->s0 = (GLfloat)rect.x / (GLfloat)ATLAS_WIDTH;
+        sprite->t0 = (GLfloat)rect.y / (GLfloat)ATLAS_HEIGHT;
+        sprite->s1 = (GLfloat)(rect.x + rect.w) / (GLfloat)ATLAS_WIDTH;
+        sprite->t1 = (GLfloat)(rect.y + rect.h) / (GLfloat)ATLAS_HEIGHT;
+}
+
+/* Use the baked atlas as the texture of every font and sprite. */
+void get_atlas_info(SDL_Surface *surf, void *texture_ptr) {
+        static const SDL_Rect font_clips[] = {
+#define OP(x, y, w, h) {x, y, w, h},
+                FOR_ATLAS_FONT_CLIP(OP)
+#undef OP
+        };
+        static const SDL_Rect font_rect = ATLAS_FONT;
+        static const SDL_Rect cursor_rect = ATLAS_CURSOR;
+        static const SDL_Rect tiles_rect = ATLAS_TILES;
+        static const SDL_Rect lamb_rect = ATLAS_LAMB;
+        GLuint texture = *(GLuint *)texture_ptr;
+        size_t num_glyphs = strlen(_font.alphabet);
+
+        USED(surf);
+
+        if (num_glyphs > sizeof font_clips / sizeof *font_clips) {
+                die("atlas: the font has too few glyphs\n");
+        }
+
+        _font.texture = texture;
+        _font.image_width = ATLAS_WIDTH;
+        _font.image_height = ATLAS_HEIGHT;
+        memcpy(_font.clips, font_clips, num_glyphs * sizeof *font_clips);
+        _font.height = font_rect.h;
+        build_font_glyphs(&_font);
+
+        _set_atlas_sprite(&_cursor_sprite, texture, cursor_rect);
+        _set_atlas_sprite(&_tiles_sprite, texture, tiles_rect);
+        _set_atlas_sprite(&_lamb_sprite, texture, lamb_rect);
+}
+
+#ifdef LAMBHORN_DEVELOPMENT
+/* The loose images and what to do with each once it has loaded */
+static struct loose_image _loose_images[] = {
+        {"data/images/cursor.png", &_cursor_sprite.texture, &get_sprite_dims_from_surface, &_cursor_sprite, 0, 0},
+        {"data/images/font.png", &_font.texture, &get_font_info_from_surface, &_font, 0, 0},
+        {"data/images/tiles.png", &_tiles_sprite.texture, &get_sprite_dims_from_surface, &_tiles_sprite, 0, 0},
+        {"data/images/lamb.png", &_lamb_sprite.texture, &get_sprite_dims_from_surface, &_lamb_sprite, 0, 0}
+};
+#define NUM_LOOSE_IMAGES (int)(sizeof _loose_images / sizeof *_loose_images)
+/* The directory of the loose images */
+#define LOOSE_IMAGE_DIR "data/images"
+
+/* The inotify instance watching the loose images, or -1 */
+static int _image_watch = -1;
+
+/* Take in a loose image that has finished loading, or failed to, and
+ * load it again if it changed in the meantime. */
+static void _finish_loading_image(SDL_Surface *surf, void *image_ptr) {
+        struct loose_image *image = image_ptr;
+
+        image->loading = 0;
+        if (surf) {
+                image->surface_handler(surf, image->data);
+
+                /* The meshes of every world hold the texture coordinates
+                 * of the tiles. */
+                if (image->data == &_tiles_sprite) {
+                        _tiles_generation++;
+                }
+        }
+
+        if (image->changed) {
+                image->changed = 0;
+                image->loading = 1;
+                reload_gl_texture_async(image->path,
+                                        image->texture,
+                                        &_finish_loading_image,
+                                        image);
+        }
+}
+
+/* Load every loose image in the background. */
+void load_loose_images(void) {
+        int i;
+
+        for (i = 0; i < NUM_LOOSE_IMAGES; i++) {
+                struct loose_image *image = &_loose_images[i];
+
+                image->loading = 1;
+                load_gl_texture_async(image->path,
+                                      image->texture,
+                                      &_finish_loading_image,
+                                      image);
+        }
+}
+
+/* Start watching the loose images for changes.  Without inotify the
+ * game still runs, only without reloading images. */
+void start_watching_images(void) {
+        _image_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_image_watch == -1) {
+                fprintf(stderr, "inotify_init1: %s\n", strerror(errno));
+                return;
+        }
+
+        /* Editors that save by renaming a new file over the old one are
+         * seen moving it in. */
+        if (inotify_add_watch(_image_watch, LOOSE_IMAGE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+                fprintf(stderr, "inotify_add_watch: %s: %s\n", LOOSE_IMAGE_DIR, strerror(errno));
+                close(_image_watch);
+                _image_watch = -1;
+        }
+}
+
+/* Stop watching the loose images. */
+void stop_watching_images(void) {
+        if (_image_watch != -1) {
+                close(_image_watch);
+                _image_watch = -1;
+        }
+}
+
+/* Load again the loose images that have changed since the last check,
+ * and return the number of loads started.  Only the changed images are
+ * decoded, in the background, and each keeps its old texture until the
+ * new one is uploaded. */
+int update_image_watch(void) {
+        union {
+                struct inotify_event event;
+                char bytes[4096];
+        } buffer;
+        ssize_t size;
+        int num_started = 0;
+
+        if (_image_watch == -1) {
+                return 0;
+        }
+
+        while ((size = read(_image_watch, &buffer, sizeof buffer)) > 0) {
+                const char *p = buffer.bytes;
+
+                while (p < buffer.bytes + size) {
+                        const struct inotify_event *event = (const struct inotify_event *)p;
+                        int i;
+
+                        p += sizeof *event + event->len;
+                        if (event->len == 0) {
+                                continue;
+                        }
+
+                        for (i = 0; i < NUM_LOOSE_IMAGES; i++) {
+                                struct loose_image *image = &_loose_images[i];
+
+                                if (strcmp(strrchr(image->path, '/') + 1, event->name) != 0) {
+                                        continue;
+                                }
+
+                                /* Wait for a load under way to finish, so
+                                 * that the newest image is uploaded last. */
+                                if (image->loading) {
+                                        image->changed = 1;
+                                } else {
+                                        image->loading = 1;
+                                        reload_gl_texture_async(image->path,
+                                                                image->texture,
+                                                                &_finish_loading_image,
+                                                                image);
+                                        num_started++;
+                                }
+                        }
+                }
+        }
+
+        return num_started;
+}
+#endif
+
+/* Draw a menu with the cursor at a certain row, once its font and cursor
+ * have loaded. */
+void draw_menu(const struct menu *menu, int selection, GLfloat row) {
+        int x = 0;
+        int y;
+        struct quad quad;
+        Uint64 start;
+
+        if (!_font.texture || !_cursor_sprite.texture) {
+                return;
+        }
+
+        /* Draw the prompt and the options, then the description of the
+         * selected option wrapped beside them.  Both are cached, so each
+         * costs a single draw call. */
+        start = profile_begin();
+        draw_cached_text(&_font, 9, WINDOW_HEIGHT - 5, menu->text);
+        profile_end(PROFILE_TEXT, start);
+        start = profile_begin();
+        draw_text_box(&_font,
+                      100,
+                      WINDOW_HEIGHT - (5 + ((_font.height + 1) * 2)),
+                      DESCRIPTION_WIDTH,
+                      TEXT_ALIGN_LEFT,
+                      DESCRIPTION_MAX_LINES,
+                      menu->descriptions[selection]);
+        profile_end(PROFILE_TEXT, start);
+
+        /* Draw the cursor, snapped to whole pixels. */
+        start = profile_begin();
+        y = WINDOW_HEIGHT - (5 - ((_cursor_sprite.height - _font.height) / 2)) - (int)((GLfloat)(_font.height + 1) * (2.0f + row) + 0.5f);
+        quad.x0 = (GLfloat)x;
+        quad.y0 = (GLfloat)y;
+        quad.x1 = (GLfloat)(x + _cursor_sprite.width);
+        quad.y1 = (GLfloat)(y - _cursor_sprite.height);
+        quad.s0 = _cursor_sprite.s0;
+        quad.t0 = _cursor_sprite.t0;
+        quad.s1 = _cursor_sprite.s1;
+        quad.t1 = _cursor_sprite.t1;
+        draw_quads(_cursor_sprite.texture, &quad, 1);
+        profile_end(PROFILE_CURSOR, start);
+}
+
+/* Draw a frame of the benchmark of a menu, stepping through its options. */
+static void _bench_menu_frame(int frame, void *menu_ptr) {
+        const struct menu *menu = menu_ptr;
+        int selection = frame % menu->num_options;
+
+        draw_menu(menu, selection, (GLfloat)selection);
+}
+
+/* Draw a frame of the text benchmark: every option and description of
+ * every menu, one string at a time through draw_text, the way text that
+ * changes each frame is drawn. */
+static void _bench_text_frame(int frame, void *menus_ptr) {
+        const struct menu *const *menus = menus_ptr;
+        int line_height = _font.height + 1;
+        int y = WINDOW_HEIGHT - 5;
+        int i;
+
+        for (; *menus; menus++) {
+                const struct menu *menu = *menus;
+
+                draw_text(&_font, 9 + frame % 8, y, menu->prompt);
+                y -= line_height;
+                for (i = 0; i < menu->num_options; i++) {
+                        draw_text(&_font, 9 + frame % 8, y, menu->options[i]);
+                        draw_text(&_font, 100, y, menu->descriptions[i]);
+                        y -= line_height;
+                }
+        }
+}
+
+/* Draw a frame of the wrapping benchmark: every description of every
+ * menu, wrapped to a box whose width changes each frame so that every
+ * layout has to be worked out again. */
+static void _bench_wrap_frame(int frame, void *menus_ptr) {
+        const struct menu *const *menus = menus_ptr;
+        int width = DESCRIPTION_WIDTH - frame % 16 * 16;
+        int y = WINDOW_HEIGHT - 5;
+        int i;
+
+        text_batch_begin(&_text_batch, &_font);
+        for (; *menus; menus++) {
+                const struct menu *menu = *menus;
+
+                for (i = 0; i < menu->num_options; i++) {
+                        const struct text_layout *layout;
+
+                        layout = layout_text(&_font,
+                                             width,
+                                             TEXT_ALIGN_LEFT,
+                                             DESCRIPTION_MAX_LINES,
+                                             menu->descriptions[i]);
+                        text_batch_add_layout(&_text_batch, 100, y, layout);
+                        y -= (_font.height + 1) * layout->num_lines;
+                }
+        }
+        text_batch_draw(&_text_batch);
+}
+
+/* Draw a frame of the world benchmark, panning the camera one tile a
+ * frame so that every chunk comes into view. */
+static void _bench_world_frame(int frame, void *map_ptr) {
+        struct tilemap *map = map_ptr;
+        int range_x = map->width - WINDOW_WIDTH / TILE_SIZE;
+        int range_y = map->height - WINDOW_HEIGHT / TILE_SIZE;
+
+        draw_tilemap(map, frame % range_x, frame * 3 % range_y);
+}
+
+/* Draw a frame of the entity benchmark, moving every entity and then
+ * drawing those in view as the camera pans. */
+static void _bench_entities_frame(int frame, void *game_ptr) {
+        struct game *game = game_ptr;
+        int range_x = game->world->width - WINDOW_WIDTH / TILE_SIZE;
+        int range_y = game->world->height - WINDOW_HEIGHT / TILE_SIZE;
+
+        update_entities(game->entities, game->world);
+        draw_tilemap(game->world, frame % range_x, frame * 3 % range_y);
+        draw_entities(game->entities, frame % range_x, frame * 3 % range_y, 1.0f);
+}
+
+/* Compare frame times for sorting. */
+static int _compare_frame_times(const void *a, const void *b) {
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+/* Time drawing a number of frames of a scene, waiting for each to finish,
+ * and print how long they took and how many draw calls they made. */
+static void _bench_scene(const char *name,
+                         int num_frames,
+                         void (*draw_frame)(int, void*),
+                         void *data)
+{
+        double *times;
+        double frequency = (double)SDL_GetPerformanceFrequency();
+        unsigned long draw_calls = 0;
+        unsigned long texture_binds = 0;
+        unsigned long heap_allocations = 0;
+        int i;
+
+        times = malloc((size_t)num_frames * sizeof *times);
+        if (!times) {
+                die("malloc: out of memory\n");
+        }
+
+        for (i = -BENCH_WARMUP_FRAMES; i < num_frames; i++) {
+                unsigned long start_draw_calls = _draw_calls;
+                unsigned long start_texture_binds = _texture_binds;
+                Uint64 start = SDL_GetPerformanceCounter();
+
+                begin_scene();
+                draw_frame(i < 0 ? 0 : i, data);
+                flush_render_queue();
+                present_scene();
+                glFinish();
+                finish_frame_allocations();
+
+                if (i >= 0) {
+                        times[i] = (double)(SDL_GetPerformanceCounter() - start)
+                                   * 1000.0 / frequency;
+                        draw_calls += _draw_calls - start_draw_calls;
+                        texture_binds += _texture_binds - start_texture_binds;
+                        heap_allocations += _frame_heap_allocations;
+                }
+        }
+
+        qsort(times, (size_t)num_frames, sizeof *times, &_compare_frame_times);
+        printf("%-10s %6d frames  min %8.3f ms  median %8.3f ms  "
+               "p99 %8.3f ms  %6.1f draw calls  %6.1f binds  "
+               "%5.2f heap allocations per frame\n",
+               name,
+               num_frames,
+               times[0],
+               times[num_frames / 2],
+               times[(num_frames - 1) * 99 / 100],
+               (double)draw_calls / (double)num_frames,
+               (double)texture_binds / (double)num_frames,
+               (double)heap_allocations / (double)num_frames);
+
+        free(times);
+}
+
+#define TITLE_MENU_PROMPT "Lambhorn"
 #define DECL_TITLE_MENU(X) \
         X("New Game", "Begin a new adventure in the land of Lambhorn.") \
         X("Quit", "Quit playing the game.")
+#define HERITAGE_MENU_PROMPT "Choose thine heritage."
 #define DECL_HERITAGE_MENU(X) \
         X("Acolith", "Acolith are pointy eared immortals.") \
         X("Caprons", "Caprons are goat headed folk from Im Otra.") \
@@ -337,48 +4014,1460 @@ void get_font_info_from_surface(SDL_Surface *surf, void *font_ptr) {
         X("Sunstruck", "Sunstruck are humans as we know them.") \
         X("Vaawie", "Vaawie are reptilians from the Rainbow Coast.") \
         X("Cancel", "Return to the previous menu.")
+#define TRADITION_MENU_PROMPT "Choose thy tradition."
 #define DECL_TRADITION_MENU(X) \
         X("Birane", "The Birane cult follows an ancient code of battle.") \
         X("Scevimric", "Scevimr people obey the orders of a far off emporer.") \
         X("Veronis", "The people of Veronis believe in folk myths of another world.") \
         X("Cancel", "Return to the previous menu.")
 
-int main(int argc, char *argv[]) {
-#define OP(option, description) option,
-        static const char *title_options[] = {DECL_TITLE_MENU(OP)};
-#undef OP
-#define OP(option, description) description,
-        static const char *title_descriptions[] = {DECL_TITLE_MENU(OP)};
-#undef OP
-#define OP(heritage, description) heritage,
-        static const char *heritage_options[] = {DECL_HERITAGE_MENU(OP)};
-#undef OP
-#define OP(heritage, description) description,
-        static const char *heritage_descriptions[] = {DECL_HERITAGE_MENU(OP)};
+#define OP(option, description) option,
+static const char *_title_options[] = {DECL_TITLE_MENU(OP)};
+#undef OP
+#define OP(option, description) description,
+static const char *_title_descriptions[] = {DECL_TITLE_MENU(OP)};
+#undef OP
+#define OP(heritage, description) heritage,
+static const char *_heritage_options[] = {DECL_HERITAGE_MENU(OP)};
+#undef OP
+#define OP(heritage, description) description,
+static const char *_heritage_descriptions[] = {DECL_HERITAGE_MENU(OP)};
+#undef OP
+#define OP(tradition, description) tradition,
+static const char *_tradition_options[] = {DECL_TRADITION_MENU(OP)};
+#undef OP
+#define OP(tradition, description) description,
+static const char *_tradition_descriptions[] = {DECL_TRADITION_MENU(OP)};
+#undef OP
+/* The prompt and options of each menu laid out as one string */
+#define OP(option, description) "\n" option
+static const char _title_text[] = TITLE_MENU_PROMPT "\n" DECL_TITLE_MENU(OP);
+static const char _heritage_text[] = HERITAGE_MENU_PROMPT "\n" DECL_HERITAGE_MENU(OP);
+static const char _tradition_text[] = TRADITION_MENU_PROMPT "\n" DECL_TRADITION_MENU(OP);
+#undef OP
+
+static const struct menu _title_menu = {TITLE_MENU_PROMPT, 2, _title_options, _title_descriptions, _title_text};
+static const struct menu _heritage_menu = {HERITAGE_MENU_PROMPT, 11, _heritage_options, _heritage_descriptions, _heritage_text};
+static const struct menu _tradition_menu = {TRADITION_MENU_PROMPT, 4, _tradition_options, _tradition_descriptions, _tradition_text};
+
+/* The stats of each heritage, in the order of the heritage menu */
+static const struct stats _heritage_stats[] = {
+        {8, 3, 5, 7},           /* Acolith */
+        {10, 5, 5, 3},          /* Caprons */
+        {14, 8, 2, 3},          /* Daimyo */
+        {10, 5, 3, 5},          /* Delvren */
+        {8, 3, 6, 6},           /* Felith */
+        {7, 2, 5, 8},           /* Fleurel */
+        {11, 6, 4, 4},          /* Grimfolk */
+        {10, 5, 6, 3},          /* Los */
+        {10, 4, 4, 4},          /* Sunstruck */
+        {9, 4, 6, 4}            /* Vaawie */
+};
+
+/* What each tradition adds to the stats of a heritage, in the order of
+ * the tradition menu */
+static const struct stats _tradition_stats[] = {
+        {2, 2, 0, 0},           /* Birane */
+        {1, 0, 1, 1},           /* Scevimric */
+        {0, 0, 0, 3}            /* Veronis */
+};
+
+/* The stats of lambs */
+static const struct stats _lamb_stats = {4, 1, 3, 1};
+
+/* Switch to a menu, with the cursor on its first option. */
+static void _enter_menu(struct game *game, const struct menu *menu) {
+        game->menu = menu;
+        game->selection = 0;
+        game->cursor_row = 0.0f;
+        game->previous_cursor_row = 0.0f;
+}
+
+/* Hash a position into a pseudo-random number. */
+static Uint32 _hash_position(int x, int y, Uint32 seed) {
+        Uint32 hash = seed;
+
+        hash = (hash ^ (Uint32)x) * 0x85ebca6bU;
+        hash ^= hash >> 13;
+        hash = (hash ^ (Uint32)y) * 0xc2b2ae35U;
+        hash ^= hash >> 16;
+
+        return hash;
+}
+
+/* Sample smooth noise from 0 to 255 at a position, blending random
+ * values placed every few tiles. */
+static int _world_noise(int x, int y, int scale, Uint32 seed) {
+        int grid_x = x / scale;
+        int grid_y = y / scale;
+        int fraction_x = x % scale;
+        int fraction_y = y % scale;
+        int top_left = (int)(_hash_position(grid_x, grid_y, seed) & 255);
+        int top_right = (int)(_hash_position(grid_x + 1, grid_y, seed) & 255);
+        int bottom_left = (int)(_hash_position(grid_x, grid_y + 1, seed) & 255);
+        int bottom_right = (int)(_hash_position(grid_x + 1, grid_y + 1, seed) & 255);
+        int top = top_left + (top_right - top_left) * fraction_x / scale;
+        int bottom = bottom_left + (bottom_right - bottom_left) * fraction_x / scale;
+
+        return top + (bottom - top) * fraction_y / scale;
+}
+
+/* Fill the world with lakes, forests and hills, crossed by paths and
+ * walled in.  This is a demo scene that gives the tilemap something to
+ * draw until there are real maps to load. */
+void generate_world(struct tilemap *map) {
+        int x;
+        int y;
+
+        for (y = 0; y < map->height; y++) {
+                for (x = 0; x < map->width; x++) {
+                        int height = _world_noise(x, y, 32, 1) * 3 / 4
+                                     + _world_noise(x, y, 8, 2) / 4;
+                        Uint32 scatter = _hash_position(x, y, 3);
+                        int tile = TILE_BLANK;
+
+                        if (x == 0 || y == 0 || x == map->width - 1 || y == map->height - 1) {
+                                tile = TILE_WALL;
+                        } else if (height < 70) {
+                                tile = TILE_WATER;
+                        } else if (x % 64 == 32 || y % 64 == 32) {
+                                tile = TILE_PATH;
+                        } else if (height > 190 && scatter % 3 == 0) {
+                                tile = TILE_ROCK;
+                        } else if (height > 150 && scatter % 4 == 0) {
+                                tile = TILE_TREE;
+                        } else if (height > 110 && scatter % 3 == 0) {
+                                tile = TILE_TALL_GRASS;
+                        } else if (scatter % 5 == 0) {
+                                tile = TILE_GRASS;
+                        }
+
+                        set_tile(map, x, y, tile);
+                }
+        }
+}
+
+/* Start a game over at the title menu, in the world as it is. */
+void restart_game(struct game *game) {
+        game->mode = GAME_MODE_MENU;
+        game->tick = 0;
+        game->quit = 0;
+        _enter_menu(game, &_title_menu);
+
+        game->world = &_world;
+        game->camera_x = (WORLD_WIDTH - WINDOW_WIDTH / TILE_SIZE) / 2;
+        game->camera_y = (WORLD_HEIGHT - WINDOW_HEIGHT / TILE_SIZE) / 2;
+
+        if (!_entities.x) {
+                create_entities(&_entities);
+        }
+        clear_entities(&_entities);
+        game->entities = &_entities;
+        game->player = ENTITY_NONE;
+        game->heritage = 0;
+        game->tradition = 0;
+        game->tile_edits = NULL;
+        game->unsaved = 0;
+}
+
+/* Start a new game at the title menu, in a new world. */
+void start_game(struct game *game) {
+        if (!_world.chunks) {
+                create_tilemap(&_world, WORLD_WIDTH, WORLD_HEIGHT);
+        }
+        generate_world(&_world);
+        restart_game(game);
+}
+
+/* Change a tile of the world, and pass the change on to the copy that is
+ * drawn, if there is one. */
+static void _edit_world(struct game *game, int x, int y, int tile) {
+        struct tile_edit edit;
+
+        set_tile(game->world, x, y, tile);
+        game->unsaved |= 1u << SAVE_SECTION_WORLD;
+        if (!game->tile_edits) {
+                return;
+        }
+
+        edit.x = (Uint16)x;
+        edit.y = (Uint16)y;
+        edit.tile = (Uint8)tile;
+
+        /* The render thread empties the queue every frame. */
+        while (!push_queue(game->tile_edits, &edit)) {
+                SDL_Delay(1);
+        }
+}
+
+/* Send an entity wandering in a pseudo-random direction. */
+static void _wander(struct entities *entities, int i, Uint32 hash) {
+        entities->velocity_x[i] = ((GLfloat)(hash & 255) / 127.5f - 1.0f) * LAMB_SPEED;
+        entities->velocity_y[i] = ((GLfloat)(hash >> 8 & 255) / 127.5f - 1.0f) * LAMB_SPEED;
+}
+
+/* Turn the lambs from one in every LAMB_TURN_TICKS, so that each lamb
+ * turns every LAMB_TURN_TICKS ticks. */
+static void _herd_lambs(struct game *game) {
+        struct entities *entities = game->entities;
+        int i;
+
+        for (i = (int)(game->tick % LAMB_TURN_TICKS); i < entities->count; i += LAMB_TURN_TICKS) {
+                if (entities->sprite[i] == ENTITY_SPRITE_LAMB) {
+                        _wander(entities, i, _hash_position(entities->slot[i], (int)game->tick, 4));
+                }
+        }
+}
+
+/* Scatter a number of lambs across the world. */
+static void _spawn_lambs(struct game *game, int num_lambs) {
+        int i;
+
+        for (i = 0; i < num_lambs; i++) {
+                Uint32 hash = _hash_position(i, 0, 5);
+                GLfloat x = (GLfloat)(1 + (int)(hash % (Uint32)(game->world->width - 2)));
+                GLfloat y = (GLfloat)(1 + (int)((hash >> 16) % (Uint32)(game->world->height - 2)));
+
+                if (spawn_entity(game->entities, x, y, ENTITY_SPRITE_LAMB, &_lamb_stats) == ENTITY_NONE) {
+                        break;
+                }
+                _wander(game->entities, game->entities->count - 1, hash >> 8);
+        }
+}
+
+/* Fill the world with the player, in the middle of the view, and the
+ * lambs if asked for. */
+static void _populate_world(struct game *game) {
+        const struct stats *heritage = &_heritage_stats[game->heritage];
+        const struct stats *tradition = &_tradition_stats[game->tradition];
+        struct stats stats;
+
+        stats.health = (Sint16)(heritage->health + tradition->health);
+        stats.might = (Sint16)(heritage->might + tradition->might);
+        stats.agility = (Sint16)(heritage->agility + tradition->agility);
+        stats.wits = (Sint16)(heritage->wits + tradition->wits);
+
+        clear_entities(game->entities);
+        game->player = spawn_entity(game->entities,
+                                    (GLfloat)(game->camera_x + WINDOW_WIDTH / TILE_SIZE / 2),
+                                    (GLfloat)(game->camera_y + WINDOW_HEIGHT / TILE_SIZE / 2),
+                                    ENTITY_SPRITE_PLAYER,
+                                    &stats);
+        if (_herding) {
+                _spawn_lambs(game, NUM_LAMBS);
+        }
+}
+
+/* Move the camera by a number of tiles, keeping the view in the world. */
+static void _move_camera(struct game *game, int dx, int dy) {
+        int max_x = game->world->width - WINDOW_WIDTH / TILE_SIZE;
+        int max_y = game->world->height - WINDOW_HEIGHT / TILE_SIZE;
+
+        game->camera_x += dx;
+        game->camera_y += dy;
+        if (game->camera_x > max_x) {
+                game->camera_x = max_x;
+        }
+        if (game->camera_y > max_y) {
+                game->camera_y = max_y;
+        }
+        if (game->camera_x < 0) {
+                game->camera_x = 0;
+        }
+        if (game->camera_y < 0) {
+                game->camera_y = 0;
+        }
+        game->unsaved |= 1u << SAVE_SECTION_GAME;
+}
+
+/* Change the game according to an input event. */
+void handle_game_event(struct game *game, const SDL_Event *event) {
+        if (event->type == SDL_QUIT) {
+                game->quit = 1;
+        } else if (event->type == SDL_KEYDOWN) {
+                switch (event->key.keysym.scancode) {
+                        case SDL_SCANCODE_ESCAPE:
+                                game->quit = 1;
+                                break;
+                        case SDL_SCANCODE_DOWN:
+                                if (game->mode == GAME_MODE_MENU) {
+                                        if (game->selection < game->menu->num_options - 1) {
+                                                game->selection++;
+                                        }
+                                } else if (game->mode == GAME_MODE_PLAY) {
+                                        _move_camera(game, 0, CAMERA_STEP);
+                                }
+                                break;
+                        case SDL_SCANCODE_UP:
+                                if (game->mode == GAME_MODE_MENU) {
+                                        if (game->selection > 0) {
+                                                game->selection--;
+                                        }
+                                } else if (game->mode == GAME_MODE_PLAY) {
+                                        _move_camera(game, 0, -CAMERA_STEP);
+                                }
+                                break;
+                        case SDL_SCANCODE_LEFT:
+                                if (game->mode == GAME_MODE_PLAY) {
+                                        _move_camera(game, -CAMERA_STEP, 0);
+                                }
+                                break;
+                        case SDL_SCANCODE_RIGHT:
+                                if (game->mode == GAME_MODE_PLAY) {
+                                        _move_camera(game, CAMERA_STEP, 0);
+                                }
+                                break;
+                        case SDL_SCANCODE_SPACE:
+                                if (game->mode == GAME_MODE_MENU) {
+                                        if (game->menu == &_title_menu) {
+                                                if (game->selection == 0) {
+                                                        /* New Game */
+                                                        _enter_menu(game, &_heritage_menu);
+                                                } else if (game->selection == 1) {
+                                                        game->quit = 1;
+                                                }
+                                        } else if (game->menu == &_heritage_menu) {
+                                                if (game->selection == 10) {
+                                                        _enter_menu(game, &_title_menu);
+                                                } else {
+                                                        game->heritage = game->selection;
+                                                        _enter_menu(game, &_tradition_menu);
+                                                }
+                                        } else if (game->menu == &_tradition_menu) {
+                                                if (game->selection == 3) {
+                                                        _enter_menu(game, &_heritage_menu);
+                                                } else {
+                                                        game->tradition = game->selection;
+                                                        game->mode = GAME_MODE_PLAY;
+                                                        _populate_world(game);
+                                                        /* Save everything,
+                                                         * starting with the
+                                                         * new character. */
+                                                        game->unsaved = ~0u;
+                                                }
+                                        }
+                                } else if (game->mode == GAME_MODE_PLAY) {
+                                        /* Change the tile in the middle of
+                                         * the view to the next kind, a demo
+                                         * of rebuilding only the chunks
+                                         * whose tiles change. */
+                                        int x = game->camera_x + WINDOW_WIDTH / TILE_SIZE / 2;
+                                        int y = game->camera_y + WINDOW_HEIGHT / TILE_SIZE / 2;
+
+                                        _edit_world(game,
+                                                    x,
+                                                    y,
+                                                    (get_tile(game->world, x, y) + 1) % NUM_TILES);
+                                }
+                                break;
+                        default:
+                                break;
+                }
+        }
+}
+
+/* Advance the game by one tick. */
+void tick_game(struct game *game) {
+        /* Move the cursor to the selection, keeping where it was so that
+         * drawing can interpolate between the two. */
+        game->previous_cursor_row = game->cursor_row;
+        game->cursor_row = (GLfloat)game->selection;
+
+        /* Move everything in the world.  Only a tick that changes the
+         * entities needs saving. */
+        if (game->mode == GAME_MODE_PLAY) {
+                _herd_lambs(game);
+                if (_entities_are_moving(game->entities)) {
+                        update_entities(game->entities, game->world);
+                        game->unsaved |= 1u << SAVE_SECTION_GAME | 1u << SAVE_SECTION_ENTITIES;
+                }
+        }
+
+        game->tick++;
+}
+
+/* Add bytes to an FNV-1a checksum. */
+static Uint32 _checksum(Uint32 checksum, const void *data, size_t size) {
+        const Uint8 *bytes = data;
+        size_t i;
+
+        for (i = 0; i < size; i++) {
+                checksum = (checksum ^ bytes[i]) * 16777619U;
+        }
+
+        return checksum;
+}
+
+/* Round a size up to the alignment of save sections. */
+static Uint32 _align_save_size(Uint32 size) {
+        return (size + SAVE_ALIGNMENT - 1) / SAVE_ALIGNMENT * SAVE_ALIGNMENT;
+}
+
+/* Start writing a section at an offset in a save, or only measuring it
+ * if there is no file. */
+static void _start_save_writer(struct save_writer *writer, int fd, Uint32 offset) {
+        writer->fd = fd;
+        writer->offset = offset;
+        writer->size = 0;
+        writer->checksum = 2166136261U;
+        writer->failed = 0;
+}
+
+/* Write the next part of a section. */
+static void _write_save_part(struct save_writer *writer, const void *data, size_t size) {
+        if (writer->fd != -1 && !writer->failed) {
+                writer->checksum = _checksum(writer->checksum, data, size);
+                if (pwrite(writer->fd, data, size, (off_t)writer->offset) != (ssize_t)size) {
+                        writer->failed = 1;
+                }
+        }
+        writer->offset += (Uint32)size;
+        writer->size += (Uint32)size;
+}
+
+/* Write the character made in the menus. */
+static void _write_character_section(struct save_writer *writer, const struct game *game) {
+        struct save_character character;
+
+        memset(&character, 0, sizeof character);
+        character.heritage = (Uint32)game->heritage;
+        character.tradition = (Uint32)game->tradition;
+        _write_save_part(writer, &character, sizeof character);
+}
+
+/* Write where the game is up to. */
+static void _write_game_section(struct save_writer *writer, const struct game *game) {
+        struct save_game state;
+
+        memset(&state, 0, sizeof state);
+        state.tick = game->tick;
+        state.camera_x = game->camera_x;
+        state.camera_y = game->camera_y;
+        state.player = game->player;
+        _write_save_part(writer, &state, sizeof state);
+}
+
+/* Write the tiles of the world, a chunk at a time. */
+static void _write_world_section(struct save_writer *writer, const struct game *game) {
+        const struct tilemap *map = game->world;
+        struct save_world world;
+        int i;
+
+        memset(&world, 0, sizeof world);
+        world.width = (Uint32)map->width;
+        world.height = (Uint32)map->height;
+        world.chunk_size = CHUNK_SIZE;
+        _write_save_part(writer, &world, sizeof world);
+
+        for (i = 0; i < map->chunks_wide * map->chunks_high; i++) {
+                _write_save_part(writer, map->chunks[i].tiles, sizeof map->chunks[i].tiles);
+        }
+}
+
+/* Write the entity store, an array at a time.  Only the slots that have
+ * been handed out are written.  The rest are still at the bottom of the
+ * free slots, in order, with their first generation. */
+static void _write_entities_section(struct save_writer *writer, const struct game *game) {
+        const struct entities *entities = game->entities;
+        int num_unused = MAX_ENTITIES - entities->num_slots;
+        struct save_entities header;
+
+        memset(&header, 0, sizeof header);
+        header.count = (Uint32)entities->count;
+        header.capacity = (Uint32)entities->num_slots;
+        header.num_free_slots = (Uint32)(entities->num_free_slots - num_unused);
+        _write_save_part(writer, &header, sizeof header);
+
+#define OP(type, name) \
+        _write_save_part(writer, \
+                         entities->name, \
+                         (size_t)entities->count * sizeof *entities->name);
+        FOR_ENTITY_COMPONENT(OP)
+#undef OP
+        _write_save_part(writer, entities->index, header.capacity * sizeof *entities->index);
+        _write_save_part(writer, entities->generation, header.capacity * sizeof *entities->generation);
+        _write_save_part(writer,
+                         entities->free_slots + num_unused,
+                         header.num_free_slots * sizeof *entities->free_slots);
+}
+
+/* Read the character made in the menus. */
+static int _read_character_section(struct game *game, const Uint8 *data, Uint32 size) {
+        struct save_character character;
+
+        if (size != sizeof character) {
+                return 0;
+        }
+        memcpy(&character, data, sizeof character);
+        if (character.heritage >= sizeof _heritage_stats / sizeof *_heritage_stats
+            || character.tradition >= sizeof _tradition_stats / sizeof *_tradition_stats) {
+                return 0;
+        }
+
+        game->heritage = (int)character.heritage;
+        game->tradition = (int)character.tradition;
+        return 1;
+}
+
+/* Read where the game is up to. */
+static int _read_game_section(struct game *game, const Uint8 *data, Uint32 size) {
+        struct save_game state;
+
+        if (size != sizeof state) {
+                return 0;
+        }
+        memcpy(&state, data, sizeof state);
+
+        game->tick = state.tick;
+        game->camera_x = state.camera_x;
+        game->camera_y = state.camera_y;
+        game->player = state.player;
+        _move_camera(game, 0, 0);
+        return 1;
+}
+
+/* Read the tiles of the world, a chunk at a time. */
+static int _read_world_section(struct game *game, const Uint8 *data, Uint32 size) {
+        struct tilemap *map = game->world;
+        int num_chunks = map->chunks_wide * map->chunks_high;
+        struct save_world world;
+        int i;
+
+        if (size != sizeof world + (size_t)num_chunks * sizeof map->chunks->tiles) {
+                return 0;
+        }
+        memcpy(&world, data, sizeof world);
+        if (world.width != (Uint32)map->width
+            || world.height != (Uint32)map->height
+            || world.chunk_size != CHUNK_SIZE) {
+                return 0;
+        }
+        data += sizeof world;
+
+        for (i = 0; i < num_chunks; i++) {
+                memcpy(map->chunks[i].tiles, data, sizeof map->chunks[i].tiles);
+                map->chunks[i].dirty = 1;
+                data += sizeof map->chunks[i].tiles;
+        }
+        map->edits++;
+        return 1;
+}
+
+/* Read the entity store, an array at a time. */
+static int _read_entities_section(struct game *game, const Uint8 *data, Uint32 size) {
+        struct entities *entities = game->entities;
+        struct save_entities header;
+        size_t expected = sizeof header;
+        int num_unused;
+        int i;
+
+        if (size < sizeof header) {
+                return 0;
+        }
+        memcpy(&header, data, sizeof header);
+        if (header.capacity > MAX_ENTITIES
+            || header.count > header.capacity
+            || header.num_free_slots != header.capacity - header.count) {
+                return 0;
+        }
+#define OP(type, name) expected += header.count * sizeof(type);
+        FOR_ENTITY_COMPONENT(OP)
+#undef OP
+        expected += header.capacity * (sizeof *entities->index + sizeof *entities->generation)
+                    + header.num_free_slots * sizeof *entities->free_slots;
+        if (size != expected) {
+                return 0;
+        }
+        data += sizeof header;
+
+#define OP(type, name) \
+        memcpy(entities->name, data, header.count * sizeof(type)); \
+        data += header.count * sizeof(type);
+        FOR_ENTITY_COMPONENT(OP)
+#undef OP
+        memcpy(entities->index, data, header.capacity * sizeof *entities->index);
+        data += header.capacity * sizeof *entities->index;
+        memcpy(entities->generation, data, header.capacity * sizeof *entities->generation);
+        data += header.capacity * sizeof *entities->generation;
+
+        /* Put back the slots that were never handed out. */
+        num_unused = MAX_ENTITIES - (int)header.capacity;
+        for (i = 0; i < num_unused; i++) {
+                entities->generation[MAX_ENTITIES - 1 - i] = 1;
+                entities->free_slots[i] = (Uint16)(MAX_ENTITIES - 1 - i);
+        }
+        memcpy(entities->free_slots + num_unused,
+               data,
+               header.num_free_slots * sizeof *entities->free_slots);
+        entities->count = (int)header.count;
+        entities->num_free_slots = num_unused + (int)header.num_free_slots;
+        entities->num_slots = (int)header.capacity;
+        return 1;
+}
+
+/* The kind, writer and reader of each section of a save */
+static const Uint32 _save_kinds[] = {
+#define OP(id, name) SAVE_SECTION_##id,
+        FOR_SAVE_SECTION(OP)
+#undef OP
+};
+static void (*const _save_writers[])(struct save_writer*, const struct game*) = {
+#define OP(id, name) &_write_##name##_section,
+        FOR_SAVE_SECTION(OP)
+#undef OP
+};
+static int (*const _save_readers[])(struct game*, const Uint8*, Uint32) = {
+#define OP(id, name) &_read_##name##_section,
+        FOR_SAVE_SECTION(OP)
+#undef OP
+};
+
+/* Sync a written save to disk, then switch its table over to the new
+ * copies of its sections, or put the new file in place of the old one.
+ * Return whether it worked. */
+static int _finish_save(void *unused) {
+        struct save_finish *finish = &_save_finish;
+        int failed;
+
+        /* Switch the whole table over to the new copies in one write. */
+        failed = fsync(finish->fd) == -1
+                 || (!finish->whole
+                     && (pwrite(finish->fd,
+                                finish->table,
+                                sizeof finish->table,
+                                sizeof(struct save_header)) != (ssize_t)sizeof finish->table
+                         || fsync(finish->fd) == -1));
+
+        /* The descriptor is gone even if closing it fails, and by then its
+         * number may belong to a file another thread has opened. */
+        if (close(finish->fd) == -1) {
+                failed = 1;
+        }
+
+        if (failed || (finish->whole && rename(finish->temp_path, finish->path) == -1)) {
+                fprintf(stderr,
+                        "lambhorn: cannot write %s: %s\n",
+                        finish->whole ? finish->temp_path : finish->path,
+                        strerror(errno));
+                if (finish->whole) {
+                        unlink(finish->temp_path);
+                }
+                failed = 1;
+        }
+
+        SDL_AtomicSet(&_save_finishing, 0);
+        return !failed;
+}
+
+/* Hand a written save over to a thread to finish it, so that the
+ * simulation never waits for the disk. */
+static void _start_finishing_save(void) {
+        SDL_AtomicSet(&_save_finishing, 1);
+        _save_finisher = SDL_CreateThread(&_finish_save, "save", NULL);
+        if (!_save_finisher) {
+                die("SDL_CreateThread: %s\n", SDL_GetError());
+        }
+}
+
+/* Clean up after the thread finishing the last save, waiting for it if
+ * asked to, and return whether it is still at it.  A save that could not
+ * be finished has the whole game saved again, to a new file. */
+static int _collect_save(struct game *game, int wait) {
+        int finished;
+
+        if (!_save_finisher) {
+                return 0;
+        }
+        if (!wait && SDL_AtomicGet(&_save_finishing)) {
+                return 1;
+        }
+
+        SDL_WaitThread(_save_finisher, &finished);
+        _save_finisher = NULL;
+        if (!finished) {
+                _have_save_table = 0;
+                game->unsaved = ~0u;
+        }
+        return 0;
+}
+
+/* Write every section of a save to a new file, each with room to grow
+ * and a spare copy, then have it put in place of the old one. */
+static int _write_whole_save(struct game *game, const char *path) {
+        char *temp_path = _save_finish.temp_path;
+        struct save_header header;
+        Uint32 offset;
+        int failed = 0;
+        int fd;
+        int i;
+
+        if (snprintf(temp_path, sizeof _save_finish.temp_path, "%s.tmp", path)
+            >= (int)sizeof _save_finish.temp_path) {
+                fprintf(stderr, "lambhorn: cannot save to %s: the path is too long\n", path);
+                return 0;
+        }
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                fprintf(stderr, "lambhorn: cannot write %s: %s\n", temp_path, strerror(errno));
+                return 0;
+        }
+
+        offset = _align_save_size(sizeof header + sizeof _save_table);
+        for (i = 0; i < NUM_SAVE_SECTIONS; i++) {
+                struct save_writer writer;
+
+                _start_save_writer(&writer, fd, offset);
+                _save_writers[i](&writer, game);
+                failed |= writer.failed;
+
+                memset(&_save_table[i], 0, sizeof _save_table[i]);
+                _save_table[i].kind = _save_kinds[i];
+                _save_table[i].offset = offset;
+                _save_table[i].size = writer.size;
+                _save_table[i].capacity = _align_save_size(writer.size + writer.size / 2);
+                _save_table[i].checksum = writer.checksum;
+                _save_table[i].spare = offset + _save_table[i].capacity;
+                offset += 2 * _save_table[i].capacity;
+        }
+
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, SAVE_MAGIC, sizeof SAVE_MAGIC);
+        header.version = SAVE_VERSION;
+        header.num_sections = NUM_SAVE_SECTIONS;
+
+        failed = failed
+                 || pwrite(fd, &header, sizeof header, 0) != (ssize_t)sizeof header
+                 || pwrite(fd, _save_table, sizeof _save_table, sizeof header) != (ssize_t)sizeof _save_table
+                 || ftruncate(fd, (off_t)offset) == -1;
+        if (failed) {
+                fprintf(stderr, "lambhorn: cannot write %s: %s\n", temp_path, strerror(errno));
+                close(fd);
+                unlink(temp_path);
+                _have_save_table = 0;
+                return 0;
+        }
+
+        _save_finish.fd = fd;
+        _save_finish.whole = 1;
+        _save_finish.path = path;
+        _start_finishing_save();
+        _have_save_table = 1;
+        return 1;
+}
+
+/* Save the parts of a game that changed since it was last saved.  Each
+ * changed section is written over its spare copy, and only once that is
+ * on disk is the table written again to point at it, so a save cut short
+ * leaves the last one whole.  A section that has outgrown its room, or a
+ * save that is not there yet, gets the whole file written again.  The
+ * save is finished on a thread of its own, which the next save waits
+ * for. */
+int save_game(struct game *game, const char *path) {
+        struct save_section *table = _save_finish.table;
+        int failed = 0;
+        int fd = -1;
+        int i;
+
+        /* Until the last save is finished, the table on disk still
+         * points at the copies that this one writes over. */
+        _collect_save(game, 1);
+        if (!game->unsaved) {
+                return 1;
+        }
+
+        if (_have_save_table) {
+                fd = open(path, O_WRONLY);
+        }
+        for (i = 0; fd != -1 && i < NUM_SAVE_SECTIONS; i++) {
+                struct save_writer writer;
+
+                if (game->unsaved & 1u << _save_kinds[i]) {
+                        _start_save_writer(&writer, -1, 0);
+                        _save_writers[i](&writer, game);
+                        if (writer.size > _save_table[i].capacity) {
+                                close(fd);
+                                fd = -1;
+                        }
+                }
+        }
+        if (fd == -1) {
+                if (!_write_whole_save(game, path)) {
+                        return 0;
+                }
+                game->unsaved = 0;
+                return 1;
+        }
+
+        memcpy(table, _save_table, sizeof _save_table);
+        for (i = 0; i < NUM_SAVE_SECTIONS && !failed; i++) {
+                struct save_writer writer;
+                Uint32 spare = table[i].spare;
+
+                if (!(game->unsaved & 1u << _save_kinds[i])) {
+                        continue;
+                }
+
+                _start_save_writer(&writer, fd, spare);
+                _save_writers[i](&writer, game);
+                failed = writer.failed;
+                table[i].spare = table[i].offset;
+                table[i].offset = spare;
+                table[i].size = writer.size;
+                table[i].checksum = writer.checksum;
+        }
+
+        if (failed) {
+                fprintf(stderr, "lambhorn: cannot write %s: %s\n", path, strerror(errno));
+                close(fd);
+                _have_save_table = 0;
+                return 0;
+        }
+
+        _save_finish.fd = fd;
+        _save_finish.whole = 0;
+        _save_finish.path = path;
+        _start_finishing_save();
+        memcpy(_save_table, table, sizeof _save_table);
+        game->unsaved = 0;
+        return 1;
+}
+
+/* Load a saved game over a new one, mapping the save into memory and
+ * copying each section straight out of it. */
+int load_game(struct game *game,
+              const char *path,
+              void (*print_error)(const char*, ...)) {
+        const struct save_header *header;
+        const struct save_section *sections;
+        const Uint8 *data;
+        struct stat st;
+        size_t size;
+        Uint32 found = 0;
+        int in_order;
+        int fd;
+        Uint32 i;
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                print_error("open: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        if (fstat(fd, &st) == -1) {
+                close(fd);
+                print_error("fstat: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        size = (size_t)st.st_size;
+        if (size < sizeof(struct save_header)) {
+                close(fd);
+                print_error("%s: not a saved game\n", path);
+                return 0;
+        }
+
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                print_error("mmap: %s: %s\n", path, strerror(errno));
+                return 0;
+        }
+
+        header = (const struct save_header *)data;
+        sections = (const struct save_section *)(header + 1);
+        if (memcmp(header->magic, SAVE_MAGIC, sizeof SAVE_MAGIC) != 0
+            || header->version != SAVE_VERSION
+            || header->num_sections
+               > (size - sizeof(struct save_header)) / sizeof(struct save_section)) {
+                munmap((void *)data, size);
+                print_error("%s: not a saved game\n", path);
+                return 0;
+        }
+
+        /* Read each section that this version knows of. */
+        in_order = header->num_sections == NUM_SAVE_SECTIONS;
+        for (i = 0; i < header->num_sections; i++) {
+                const struct save_section *section = &sections[i];
+                int j;
+
+                if (section->offset > size
+                    || section->size > size - section->offset
+                    || section->size > section->capacity
+                    || _checksum(2166136261U, data + section->offset, section->size)
+                       != section->checksum) {
+                        munmap((void *)data, size);
+                        print_error("%s: corrupt saved game\n", path);
+                        return 0;
+                }
+
+                for (j = 0; j < NUM_SAVE_SECTIONS; j++) {
+                        if (_save_kinds[j] == section->kind) {
+                                break;
+                        }
+                }
+                if (j == NUM_SAVE_SECTIONS) {
+                        in_order = 0;
+                        continue;
+                }
+                if (!_save_readers[j](game, data + section->offset, section->size)) {
+                        munmap((void *)data, size);
+                        print_error("%s: corrupt saved game\n", path);
+                        return 0;
+                }
+                found |= 1u << j;
+
+                /* The spare copy has to be in the save, clear of the
+                 * copy in use, for changes to be written over it. */
+                if (i == (Uint32)j
+                    && section->spare <= size
+                    && section->capacity <= size - section->spare
+                    && ((size_t)section->spare >= (size_t)section->offset + section->capacity
+                        || (size_t)section->offset >= (size_t)section->spare + section->capacity)) {
+                        _save_table[j] = *section;
+                } else {
+                        in_order = 0;
+                }
+        }
+        munmap((void *)data, size);
+
+        if (found != (1u << NUM_SAVE_SECTIONS) - 1) {
+                print_error("%s: incomplete saved game\n", path);
+                return 0;
+        }
+
+        /* Changed sections can be written over their spare copies if
+         * the table is laid out the way this version writes it. */
+        _have_save_table = in_order;
+        game->mode = GAME_MODE_PLAY;
+        game->unsaved = 0;
+        return 1;
+}
+
+
+/* Start recording input to a file. */
+void start_recording(const char *path) {
+        char magic[8] = RECORDING_MAGIC;
+        Uint32 version = RECORDING_VERSION;
+
+        _recording = fopen(path, "wb");
+        if (!_recording) {
+                die("lambhorn: cannot write %s: %s\n", path, strerror(errno));
+        }
+
+        if (fwrite(magic, sizeof magic, 1, _recording) != 1
+            || fwrite(&version, sizeof version, 1, _recording) != 1) {
+                die("lambhorn: cannot write %s\n", path);
+        }
+}
+
+/* Whether an input event is one that changes the game */
+static int _is_game_event(const SDL_Event *event) {
+        return event->type == SDL_QUIT || event->type == SDL_KEYDOWN;
+}
+
+/* Record an input event, if it is one that changes the game. */
+void record_event(Uint32 tick, const SDL_Event *event) {
+        struct input_record record;
+
+        if (!_recording || !_is_game_event(event)) {
+                return;
+        }
+
+        record.tick = tick;
+        record.type = (Uint16)event->type;
+        record.scancode = event->type == SDL_KEYDOWN
+                          ? (Uint16)event->key.keysym.scancode
+                          : 0;
+        if (fwrite(&record, sizeof record, 1, _recording) != 1) {
+                die("lambhorn: cannot write the input recording\n");
+        }
+}
+
+/* Finish recording input. */
+void stop_recording(void) {
+        if (_recording) {
+                if (fclose(_recording) != 0) {
+                        fprintf(stderr, "lambhorn: cannot write the input recording\n");
+                }
+                _recording = NULL;
+        }
+}
+
+/* Load the records of an input recording. */
+struct input_record *load_recording(const char *path, int *num_records) {
+        char magic[8];
+        Uint32 version;
+        struct input_record *records = NULL;
+        int max_records = 0;
+        FILE *in;
+
+        in = fopen(path, "rb");
+        if (!in) {
+                die("lambhorn: cannot read %s: %s\n", path, strerror(errno));
+        }
+
+        if (fread(magic, sizeof magic, 1, in) != 1
+            || fread(&version, sizeof version, 1, in) != 1
+            || memcmp(magic, RECORDING_MAGIC, sizeof RECORDING_MAGIC) != 0) {
+                die("lambhorn: %s is not an input recording\n", path);
+        }
+        if (version != RECORDING_VERSION) {
+                die("lambhorn: %s has unsupported version %u\n", path, (unsigned)version);
+        }
+
+        *num_records = 0;
+        while (1) {
+                records = _grow_buffer(records,
+                                       &max_records,
+                                       *num_records + 1,
+                                       sizeof *records);
+                if (fread(&records[*num_records], sizeof *records, 1, in) != 1) {
+                        break;
+                }
+                ++*num_records;
+        }
+        fclose(in);
+
+        return records;
+}
+
+/* Whether any entity in view of a camera moved in the last tick, with a
+ * tile to spare around the view for the sprites at its edges */
+static int _entities_moved_in_view(const struct entities *entities, int camera_x, int camera_y) {
+        GLfloat left = (GLfloat)camera_x - 1.0f;
+        GLfloat top = (GLfloat)camera_y - 1.0f;
+        GLfloat right = (GLfloat)(camera_x + WINDOW_WIDTH / TILE_SIZE + 1);
+        GLfloat bottom = (GLfloat)(camera_y + WINDOW_HEIGHT / TILE_SIZE + 1);
+        int moved = 0;
+        int i;
+
+        for (i = 0; i < entities->count; i++) {
+                GLfloat x = entities->x[i];
+                GLfloat y = entities->y[i];
+
+                moved |= ((x != entities->previous_x[i]) | (y != entities->previous_y[i]))
+                         & (x > left) & (x < right) & (y > top) & (y < bottom);
+        }
+
+        return moved;
+}
+
+/* Whether ticking a game would change it */
+static int _game_is_moving(const struct game *game) {
+        return game->cursor_row != (GLfloat)game->selection
+               || game->previous_cursor_row != game->cursor_row
+               || (game->mode == GAME_MODE_PLAY && _entities_are_moving(game->entities));
+}
+
+/* Whether a frame of a game would differ from the last one */
+static int _game_is_animating(const struct game *game) {
+        return game->cursor_row != (GLfloat)game->selection
+               || game->previous_cursor_row != game->cursor_row
+               || (game->mode == GAME_MODE_PLAY
+                   && _entities_moved_in_view(game->entities, game->camera_x, game->camera_y));
+}
+
+/* Copy the state of a game into the back snapshot and trade it for the
+ * middle one, then wake the render thread to take it. */
+static void _publish_snapshot(const struct game *game, Uint64 time, Uint64 logic_start) {
+        struct snapshot *snapshot = &_snapshots[_back_snapshot];
+        const struct entities *entities = game->entities;
+
+        snapshot->menu = game->menu;
+        snapshot->selection = game->selection;
+        snapshot->mode = game->mode;
+        snapshot->cursor_row = game->cursor_row;
+        snapshot->previous_cursor_row = game->previous_cursor_row;
+        snapshot->camera_x = game->camera_x;
+        snapshot->camera_y = game->camera_y;
+        snapshot->quit = game->quit;
+        snapshot->moving = _game_is_animating(game);
+        snapshot->time = time;
+#define OP(type, name) \
+        memcpy(snapshot->entities.name, entities->name, (size_t)entities->count * sizeof *entities->name);
+        FOR_DRAWN_ENTITY_COMPONENT(OP)
 #undef OP
-#define OP(tradition, description) tradition,
-        static const char *tradition_options[] = {DECL_TRADITION_MENU(OP)};
+        snapshot->entities.count = entities->count;
+        snapshot->logic_start = logic_start;
+        snapshot->logic_end = SDL_GetPerformanceCounter();
+
+        /* Finish writing the snapshot before handing it over, and only
+         * write the one handed back once the render thread is done with
+         * it. */
+        SDL_MemoryBarrierRelease();
+        _back_snapshot = SDL_AtomicSet(&_middle_snapshot, _back_snapshot | SNAPSHOT_FRESH)
+                         & ~SNAPSHOT_FRESH;
+        SDL_MemoryBarrierAcquire();
+
+        /* Only send a wake-up if the last one has been seen. */
+        if (SDL_AtomicCAS(&_snapshot_wake_pending, 0, 1)) {
+                SDL_Event event;
+
+                memset(&event, 0, sizeof event);
+                event.type = _snapshot_event;
+                SDL_PushEvent(&event);
+        }
+}
+
+/* Take the newest snapshot of the game, if there is a newer one than the
+ * last taken, and return it.  It stays the same until the next call.  Set
+ * is_new to whether it changed. */
+const struct snapshot *take_snapshot(int *is_new) {
+        *is_new = (SDL_AtomicGet(&_middle_snapshot) & SNAPSHOT_FRESH) != 0;
+        if (*is_new) {
+                /* Finish reading the old snapshot before handing it back,
+                 * and only read the new one once it has all been
+                 * written. */
+                SDL_MemoryBarrierRelease();
+                _front_snapshot = SDL_AtomicSet(&_middle_snapshot, _front_snapshot)
+                                  & ~SNAPSHOT_FRESH;
+                SDL_MemoryBarrierAcquire();
+        }
+
+        return &_snapshots[_front_snapshot];
+}
+
+/* Run the simulation of a game: handle input as it comes in and advance
+ * the game in fixed ticks, handing the render thread a snapshot after
+ * every change. */
+static int _run_simulation(void *game_ptr) {
+        struct game *game = game_ptr;
+        Uint64 frequency = SDL_GetPerformanceFrequency();
+        Uint64 tick_length = frequency / TICKS_PER_SECOND;
+        Uint64 last_time = SDL_GetPerformanceCounter();
+        Uint64 lag = 0;
+        Uint32 last_save_tick = game->tick;
+
+        while (SDL_AtomicGet(&_simulating)) {
+                SDL_Event event;
+                Uint64 start = SDL_GetPerformanceCounter();
+                Uint64 timeout;
+                int changed = 0;
+
+                while (pop_queue(&_input_queue, &event)) {
+                        record_event(game->tick, &event);
+                        handle_game_event(game, &event);
+                        changed = 1;
+                }
+
+                /* Advance by as many ticks as have passed. */
+                lag += start - last_time;
+                last_time = start;
+                if (lag > MAX_TICKS_PER_FRAME * tick_length) {
+                        lag = MAX_TICKS_PER_FRAME * tick_length;
+                }
+                while (lag >= tick_length) {
+                        tick_game(game);
+                        lag -= tick_length;
+                        changed = 1;
+                }
+
+                if (changed) {
+                        _publish_snapshot(game, start - lag, start);
+                }
+
+                /* Save a new character at once, and the rest of the game
+                 * every so often, but never wait for the last save to be
+                 * finished. */
+                if (_save_path
+                    && game->mode == GAME_MODE_PLAY
+                    && !_collect_save(game, 0)
+                    && game->unsaved
+                    && (game->unsaved & 1u << SAVE_SECTION_CHARACTER
+                        || game->tick - last_save_tick >= AUTOSAVE_TICKS)) {
+                        save_game(game, _save_path);
+                        last_save_tick = game->tick;
+                }
+
+                /* Sleep until input comes in.  Only wake up in time for
+                 * the next tick while something is moving. */
+                if (_game_is_moving(game)) {
+                        timeout = (tick_length - lag) * 1000 / frequency + 1;
+                } else {
+                        timeout = IDLE_TIMEOUT;
+                }
+                SDL_SemWaitTimeout(_input_ready, (Uint32)timeout);
+        }
+
+        if (_save_path && game->mode == GAME_MODE_PLAY) {
+                save_game(game, _save_path);
+                _collect_save(game, 1);
+        }
+
+        return 0;
+}
+
+/* Start simulating a game on its own thread.  From then on only that
+ * thread may touch the game; the render thread draws snapshots of it. */
+void start_simulation(struct game *game) {
+        Uint64 now;
+        int i;
+
+        create_queue(&_input_queue, INPUT_QUEUE_SIZE, sizeof(SDL_Event));
+        create_queue(&_tile_edits, TILE_EDIT_QUEUE_SIZE, sizeof(struct tile_edit));
+        _input_ready = SDL_CreateSemaphore(0);
+        if (!_input_ready) {
+                die("SDL_CreateSemaphore: %s\n", SDL_GetError());
+        }
+        _snapshot_event = SDL_RegisterEvents(1);
+        if (_snapshot_event == (Uint32)-1) {
+                die("SDL_RegisterEvents: %s\n", SDL_GetError());
+        }
+
+        for (i = 0; i < 3; i++) {
+#define OP(type, name) \
+                _snapshots[i].entities.name = malloc(MAX_ENTITIES * sizeof *_snapshots[i].entities.name); \
+                if (!_snapshots[i].entities.name) { \
+                        die("malloc: out of memory\n"); \
+                }
+                FOR_DRAWN_ENTITY_COMPONENT(OP)
 #undef OP
-#define OP(tradition, description) description,
-        static const char *tradition_descriptions[] = {DECL_TRADITION_MENU(OP)};
+        }
+
+        /* Draw a copy of the world, kept up to date with the changes that
+         * the simulation makes to it. */
+        copy_tilemap(&_world_view, game->world);
+        game->tile_edits = &_tile_edits;
+
+        /* Hand over the game as it is before it starts ticking. */
+        _back_snapshot = 0;
+        SDL_AtomicSet(&_middle_snapshot, 1);
+        _front_snapshot = 2;
+        now = SDL_GetPerformanceCounter();
+        _publish_snapshot(game, now, now);
+
+        SDL_AtomicSet(&_simulating, 1);
+        _simulation = SDL_CreateThread(&_run_simulation, "simulation", game);
+        if (!_simulation) {
+                die("SDL_CreateThread: %s\n", SDL_GetError());
+        }
+}
+
+/* Send input to the simulation thread, if it is input that changes the
+ * game.  The render thread never waits for room in the queue: input that
+ * does not fit is dropped, and said so once until there is room again. */
+void send_game_event(const SDL_Event *event) {
+        if (!_is_game_event(event)) {
+                return;
+        }
+        if (!push_queue(&_input_queue, event)) {
+                if (!_dropping_input) {
+                        fprintf(stderr, "lambhorn: too much input, dropping events\n");
+                }
+                _dropping_input = 1;
+                return;
+        }
+        _dropping_input = 0;
+        SDL_SemPost(_input_ready);
+}
+
+/* Stop the simulation thread and free what it shares with the render
+ * thread. */
+void stop_simulation(void) {
+        int i;
+
+        /* The simulation thread may be exiting from die(). */
+        if (!_simulation || SDL_ThreadID() == SDL_GetThreadID(_simulation)) {
+                return;
+        }
+
+        SDL_AtomicSet(&_simulating, 0);
+        SDL_SemPost(_input_ready);
+        SDL_WaitThread(_simulation, NULL);
+        _simulation = NULL;
+
+        for (i = 0; i < 3; i++) {
+#define OP(type, name) free(_snapshots[i].entities.name); _snapshots[i].entities.name = NULL;
+                FOR_DRAWN_ENTITY_COMPONENT(OP)
 #undef OP
-        struct {
-                const char *prompt;
-                int num_options;
-                const char **options;
-                const char **descriptions;
-        } title_menu = {"Lambhorn", 2, title_options, title_descriptions},
-          heritage_menu = {"Choose thine heritage.", 11, heritage_options, heritage_descriptions},
-          tradition_menu = {"Choose thy tradition.", 4, tradition_options, tradition_descriptions},
-          *current_menu = &title_menu;
-        enum {
-                GAME_MODE_MENU,
-                GAME_MODE_PLAY
-        } game_mode = GAME_MODE_MENU;
-        int selection = 0;
-
-        USED(argc);
-        USED(argv);
+        }
+        free_tilemap(&_world_view);
+        free_queue(&_tile_edits);
+        free_queue(&_input_queue);
+        SDL_DestroySemaphore(_input_ready);
+        _input_ready = NULL;
+}
+
+/* Play back an input recording as fast as possible, a number of times,
+ * and print how long it took. */
+static void _replay(const char *path, int repeat, int present) {
+        struct input_record *records;
+        int num_records;
+        struct game game;
+        struct tilemap world = {0, 0, 0, 0, NULL, 0};
+        unsigned long num_frames = 0;
+        Uint64 start;
+        double seconds;
+        int i;
+
+        records = load_recording(path, &num_records);
+        while (update_asset_loader(LONG_MAX, &die) > 0) {
+                SDL_Delay(1);
+        }
+
+        /* Make the world once, outside the timing, and keep a copy to
+         * undo the changes each play makes to it. */
+        start_game(&game);
+        copy_tilemap(&world, game.world);
+
+        start = SDL_GetPerformanceCounter();
+        for (i = 0; i < repeat; i++) {
+                int next = 0;
+
+                /* Feed each event in before the tick it was handled
+                 * before, and draw one frame per tick. */
+                copy_tilemap(game.world, &world);
+                restart_game(&game);
+                while (next < num_records) {
+                        while (next < num_records && records[next].tick <= game.tick) {
+                                SDL_Event event;
+
+                                memset(&event, 0, sizeof event);
+                                event.type = records[next].type;
+                                event.key.keysym.scancode = (SDL_Scancode)records[next].scancode;
+                                handle_game_event(&game, &event);
+                                next++;
+                        }
+                        if (game.quit) {
+                                break;
+                        }
+
+                        tick_game(&game);
+
+                        begin_scene();
+                        if (game.mode == GAME_MODE_MENU) {
+                                draw_menu(game.menu, game.selection, game.cursor_row);
+                        } else {
+                                draw_tilemap(game.world, game.camera_x, game.camera_y);
+                                draw_entities(game.entities, game.camera_x, game.camera_y, 1.0f);
+                        }
+                        flush_render_queue();
+                        if (present) {
+                                present_scene();
+                                glFlush();
+                                SDL_GL_SwapWindow(_window);
+                        } else {
+                                glFinish();
+                        }
+                        finish_frame_allocations();
+                        num_frames++;
+                }
+        }
+        seconds = (double)(SDL_GetPerformanceCounter() - start)
+                  / (double)SDL_GetPerformanceFrequency();
+
+        printf("replayed %s %d times: %lu frames in %.3f seconds "
+               "(%.1f frames per second)\n",
+               path,
+               repeat,
+               num_frames,
+               seconds,
+               seconds > 0.0 ? (double)num_frames / seconds : 0.0);
+
+        free_tilemap(&world);
+        free(records);
+}
+
+int main(int argc, char *argv[]) {
+        struct game game;
+        /* The state that was last drawn, to tell when to draw again */
+        const void *drawn_menu = NULL;
+        int drawn_selection = -1;
+        int drawn_game_mode = -1;
+        GLfloat drawn_cursor_row = -1.0f;
+        int drawn_camera_x = -1;
+        int drawn_camera_y = -1;
+        unsigned drawn_edits = 0;
+        int redraw = 1;
+        /* The number of images still loading */
+        int num_loading = 0;
+        /* Whether to draw every frame, even when nothing changes */
+        int continuous = 0;
+        /* Whether the cursor is moving or the game is being played */
+        int animating = 0;
+        /* The clock of the simulation and of frame pacing, in
+         * performance counter units */
+        Uint64 frequency;
+        Uint64 tick_length;
+        Uint64 frame_length;
+        Uint64 next_frame_time;
+        /* Whether to wait for vertical sync, and the frame rate cap */
+        int vsync = 0;
+        int fps_cap = -1;
+        /* The number of frames to draw of each benchmark scene, or zero
+         * to play the game */
+        int bench_frames = 0;
+        /* The recording to play back instead of playing, how many times
+         * to play it, and whether to show the frames */
+        const char *replay_path = NULL;
+        int repeat = 1;
+        int present = 1;
+        /* The renderer asked for, or NULL for the first that works */
+        const char *renderer_name = NULL;
+        /* The size of the window in multiples of the size of the game,
+         * and whether to fill the screen instead */
+        int scale = 1;
+        int fullscreen = 0;
+        /* Whether the window needs the last frame shown again */
+        int present_again = 0;
+        /* Whether to carry on from the saved game */
+        int resume = 0;
+        int i;
+
+        /* Parse the command line. */
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--continuous") == 0) {
+                        continuous = 1;
+                } else if (strcmp(argv[i], "--frame-stats") == 0) {
+                        atexit(&_print_frame_stats);
+                } else if (strcmp(argv[i], "--vsync") == 0) {
+                        vsync = 1;
+                } else if (strcmp(argv[i], "--fps-cap") == 0 && i + 1 < argc) {
+                        fps_cap = atoi(argv[++i]);
+                        if (fps_cap < 0) {
+                                die(USAGE);
+                        }
+                } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+                        bench_frames = atoi(argv[++i]);
+                        if (bench_frames < 1) {
+                                die(USAGE);
+                        }
+                } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                        _trace_path = argv[++i];
+                        _profiling = 1;
+                        _profile_start = SDL_GetPerformanceCounter();
+                        atexit(&_write_trace);
+                } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+                        start_recording(argv[++i]);
+                        atexit(&stop_recording);
+                } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+                        replay_path = argv[++i];
+                } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+                        repeat = atoi(argv[++i]);
+                        if (repeat < 1) {
+                                die(USAGE);
+                        }
+                } else if (strcmp(argv[i], "--no-present") == 0) {
+                        present = 0;
+                } else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+                        renderer_name = argv[++i];
+                } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+                        scale = atoi(argv[++i]);
+                        if (scale < 1) {
+                                die(USAGE);
+                        }
+                } else if (strcmp(argv[i], "--fullscreen") == 0) {
+                        fullscreen = 1;
+                } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+                        _save_path = argv[++i];
+                } else if (strcmp(argv[i], "--continue") == 0) {
+                        resume = 1;
+                } else if (strcmp(argv[i], "--lambs") == 0) {
+                        _herding = 1;
+                } else {
+                        die(USAGE);
+                }
+        }
 
         /* Initialize SDL. */
         if (SDL_Init(SDL_INIT_VIDEO) == -1) {
@@ -394,153 +5483,349 @@ int main(int argc, char *argv[]) {
 
         /* Set up an exit handler to free any used memory. */
         atexit(&_clean_up);
+        create_arena(&_frame_arena, FRAME_ARENA_SIZE);
 
-        /* Open the window. */
+        /* Open the window.  The game is drawn at the same size whatever
+         * the size of the window, and scaled to fit it. */
         _window = SDL_CreateWindow(WINDOW_TITLE,
                                    SDL_WINDOWPOS_UNDEFINED,
                                    SDL_WINDOWPOS_UNDEFINED,
-                                   WINDOW_WIDTH,
-                                   WINDOW_HEIGHT,
-                                   SDL_WINDOW_OPENGL);
+                                   WINDOW_WIDTH * scale,
+                                   WINDOW_HEIGHT * scale,
+                                   SDL_WINDOW_OPENGL
+                                   | SDL_WINDOW_RESIZABLE
+                                   | (fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0)
+                                   | (bench_frames || !present
+                                      ? SDL_WINDOW_HIDDEN
+                                      : 0));
         if (!_window) {
                 die("SDL_CreateWindow: %s\n", SDL_GetError());
         }
 
-        _context = SDL_GL_CreateContext(_window);
-        if (!_context) {
-                die("SDL_GL_CreateContext: %s\n", SDL_GetError());
+        /* Use the first renderer that the driver can give a context
+         * for, falling back to the legacy renderer. */
+        for (i = 0; _renderers[i]; i++) {
+                const struct renderer *renderer = _renderers[i];
+
+                if (renderer_name && strcmp(renderer_name, renderer->name) != 0) {
+                        continue;
+                }
+
+                SDL_GL_ResetAttributes();
+                if (renderer->core_profile) {
+                        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+                        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+                        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+                                            SDL_GL_CONTEXT_PROFILE_CORE);
+                }
+
+                _context = SDL_GL_CreateContext(_window);
+                if (!_context) {
+                        continue;
+                }
+
+                load_gl_procs();
+                if (renderer->init()) {
+                        _renderer = renderer;
+                        break;
+                }
+
+                renderer->quit();
+                SDL_GL_DeleteContext(_context);
+                _context = NULL;
+        }
+        if (!_renderer) {
+                die("lambhorn: cannot use the %s renderer\n",
+                    renderer_name ? renderer_name : "legacy");
+        }
+
+        /* Let vertical sync pace the frames if asked to.  Without it,
+         * cap the frame rate instead. */
+        if (vsync && SDL_GL_SetSwapInterval(1) != 0) {
+                fprintf(stderr, "SDL_GL_SetSwapInterval: %s\n", SDL_GetError());
+                vsync = 0;
+        }
+        if (fps_cap < 0) {
+                fps_cap = vsync ? 0 : DEFAULT_FPS_CAP;
         }
 
         /* Set up OpenGL. */
-        glShadeModel(GL_FLAT);
-        glViewport(0, 0, (GLsizei)WINDOW_WIDTH, (GLsizei)WINDOW_HEIGHT);
         glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        gluOrtho2D(0.0f, (GLdouble)WINDOW_WIDTH, 0.0f, (GLdouble)WINDOW_HEIGHT);
+        {
+                static const Uint8 black[3] = {0, 0, 0};
+
+                _solid_texture = create_gl_texture(1, 1, black);
+        }
+        create_scene_framebuffer();
+
+        /* Load the images in the background, so that the first frame is
+         * drawn right away. */
+        start_asset_loader();
+#ifdef LAMBHORN_DEVELOPMENT
+        /* Load the loose images, so that they can be changed without
+         * baking the asset pack again, and load each again whenever it
+         * changes. */
+        load_loose_images();
+        start_watching_images();
+        atexit(&stop_watching_images);
+#else
+        /* Load the atlas of every font and sprite from the asset pack. */
+        open_pack(&_pack, "data/lambhorn.pak", &die);
+        load_gl_texture_from_pack_async(&_pack,
+                                        "atlas",
+                                        &_atlas_texture,
+                                        &get_atlas_info,
+                                        &_atlas_texture,
+                                        &die);
+#endif
+
+        start_game(&game);
+
+        /* Benchmark drawing instead of playing, without waiting for
+         * vertical sync or the frame rate cap. */
+        if (bench_frames) {
+                const struct menu *menus[] = {
+                        &_title_menu,
+                        &_heritage_menu,
+                        &_tradition_menu,
+                        NULL
+                };
+
+                SDL_GL_SetSwapInterval(0);
+                while (update_asset_loader(LONG_MAX, &die) > 0) {
+                        SDL_Delay(1);
+                }
+
+                _bench_scene("title", bench_frames, &_bench_menu_frame, (void *)&_title_menu);
+                _bench_scene("heritage", bench_frames, &_bench_menu_frame, (void *)&_heritage_menu);
+                _bench_scene("tradition", bench_frames, &_bench_menu_frame, (void *)&_tradition_menu);
+                _bench_scene("text", bench_frames, &_bench_text_frame, menus);
+                _bench_scene("wrap", bench_frames, &_bench_wrap_frame, menus);
+                _bench_scene("world", bench_frames, &_bench_world_frame, game.world);
+
+                _spawn_lambs(&game, BENCH_ENTITIES);
+                _bench_scene("entities", bench_frames, &_bench_entities_frame, &game);
+
+                exit(EXIT_SUCCESS);
+        }
+
+        /* Play back a recording instead of playing, without waiting for
+         * vertical sync or the frame rate cap. */
+        if (replay_path) {
+                SDL_GL_SetSwapInterval(0);
+                _replay(replay_path, repeat, present);
+                exit(EXIT_SUCCESS);
+        }
+
+        /* Carry on from the saved game before the simulation and the
+         * render thread each take their copy of the world. */
+        if (resume) {
+                load_game(&game, _save_path, &die);
+        }
 
-        /* Load the cursor texture. */
-        _cursor_sprite.texture = load_gl_texture_and_handle_surface(
-            "data/images/cursor.png",
-            &get_sprite_dims_from_surface,
-            &_cursor_sprite,
-            &die);
-
-        /* Create the renderer. */
-        _font.texture = load_gl_texture_and_handle_surface(
-            "data/images/font.png",
-            &get_font_info_from_surface,
-            &_font,
-            &die);
-
-        /* Loop until the game ends. */
+        /* Simulate the game on a thread of its own, so that slow frames
+         * cannot hold up input and ticks. */
+        start_simulation(&game);
+        atexit(&stop_simulation);
+
+        /* Loop until the game ends, drawing the newest snapshot of it
+         * between its last two ticks. */
+        frequency = SDL_GetPerformanceFrequency();
+        tick_length = frequency / TICKS_PER_SECOND;
+        frame_length = fps_cap > 0 ? frequency / (Uint64)fps_cap : 0;
+        next_frame_time = SDL_GetPerformanceCounter();
+        _start_ticks = SDL_GetTicks();
         while (1) {
+                const struct snapshot *view;
                 SDL_Event event;
+                int have_event;
+                int is_new;
+                int timeout;
+                Uint64 now;
+                GLfloat alpha;
+                GLfloat row;
+                Uint64 frame_start;
+                Uint64 start;
 
-                /* Handle user input. */
-                while (SDL_PollEvent(&event)) {
-                        if (event.type == SDL_QUIT) {
-                                exit(EXIT_SUCCESS);
-                        } else if (event.type == SDL_KEYDOWN) {
-                                switch (event.key.keysym.scancode) {
-                                        case SDL_SCANCODE_ESCAPE:
-                                                exit(EXIT_SUCCESS);
-                                                break;
-                                        case SDL_SCANCODE_DOWN:
-                                                if (game_mode == GAME_MODE_MENU) {
-                                                        if (selection < current_menu->num_options - 1) {
-                                                                selection++;
-                                                        }
-                                                }
-                                                break;
-                                        case SDL_SCANCODE_UP:
-                                                if (game_mode == GAME_MODE_MENU) {
-                                                        if (selection > 0) {
-                                                                selection--;
-                                                        }
-                                                }
-                                                break;
-                                        case SDL_SCANCODE_SPACE:
-                                                if (game_mode == GAME_MODE_MENU) {
-                                                        if (current_menu == &title_menu) {
-                                                                if (selection == 0) {
-                                                                        /* New Game */
-                                                                        current_menu = &heritage_menu;
-                                                                        selection = 0;
-                                                                } else if (selection == 1) {
-                                                                        exit(EXIT_SUCCESS);
-                                                                }
-                                                        } else if (current_menu == &heritage_menu) {
-                                                                if (selection == 10) {
-                                                                        current_menu = &title_menu;
-                                                                        selection = 0;
-                                                                } else {
-                                                                        current_menu = &tradition_menu;
-                                                                        selection = 0;
-                                                                }
-                                                        } else if (current_menu == &tradition_menu) {
-                                                                if (selection == 3) {
-                                                                        current_menu = &heritage_menu;
-                                                                        selection = 0;
-                                                                } else {
-                                                                        game_mode = GAME_MODE_PLAY;
-                                                                }
-                                                        }
-                                                }
-                                                break;
-                                        default:
-                                                break;
+                /* Sleep until there is input or a new snapshot.  Only wake
+                 * up in time for the next frame while something is moving
+                 * or loading. */
+                now = SDL_GetPerformanceCounter();
+                if (!redraw && !animating && !continuous && num_loading == 0) {
+                        timeout = IDLE_TIMEOUT;
+                } else if (next_frame_time > now) {
+                        timeout = (int)((next_frame_time - now) * 1000 / frequency);
+                } else {
+                        timeout = 0;
+                }
+#ifdef LAMBHORN_DEVELOPMENT
+                /* Check for changed images every so often, even when
+                 * there is nothing else to do. */
+                if (timeout > IMAGE_WATCH_INTERVAL) {
+                        timeout = IMAGE_WATCH_INTERVAL;
+                }
+#endif
+                if (timeout > 0) {
+                        have_event = SDL_WaitEventTimeout(&event, timeout);
+                } else {
+                        have_event = SDL_PollEvent(&event);
+                }
+
+                /* Pass user input on to the simulation. */
+                frame_start = profile_begin();
+                start = frame_start;
+                for (; have_event; have_event = SDL_PollEvent(&event)) {
+                        if (event.type == _snapshot_event) {
+                                /* The snapshot is taken below. */
+                                SDL_AtomicSet(&_snapshot_wake_pending, 0);
+                        } else if (event.type == SDL_WINDOWEVENT) {
+                                /* The window may need to be drawn again,
+                                 * which only takes showing the last frame
+                                 * if it was kept. */
+                                if (_scene_framebuffer && _frames_drawn > 0) {
+                                        present_again = 1;
+                                } else {
+                                        redraw = 1;
                                 }
+                        } else if (event.type == SDL_KEYDOWN
+                                   && event.key.keysym.scancode == SDL_SCANCODE_F3) {
+                                /* Toggle the profiler overlay. */
+                                _show_profile = !_show_profile;
+                                _profiling = _show_profile || _trace_path;
+                                redraw = 1;
+                        } else {
+                                send_game_event(&event);
                         }
                 }
+                profile_end(PROFILE_EVENTS, start);
 
-                /* Clear the screen. */
-                glClear(GL_COLOR_BUFFER_BIT);
-
-                if (game_mode == GAME_MODE_MENU) {
-                        /* Enable texturing. */
-                        glEnable(GL_TEXTURE_2D);
-                        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-
-                        /* Draw the menu prompt. */
-                        draw_text(&_font, 9, WINDOW_HEIGHT - 5, current_menu->prompt);
+                /* Upload any images that have finished decoding, after
+                 * starting to load again any that have changed.  Each
+                 * finished image may change what is on the screen. */
+                start = profile_begin();
+#ifdef LAMBHORN_DEVELOPMENT
+                num_loading += update_image_watch();
+#endif
+                {
+                        int still_loading;
 
-                        /* Draw the options. */
-                        {
-                                int i;
-                                for (i = 0; i < current_menu->num_options; i++) {
-                                        draw_text(&_font, 9, WINDOW_HEIGHT - (5 + ((_font.height + 1) * (2 + i))), current_menu->options[i]);
-                                }
+                        still_loading = update_asset_loader(ASSET_UPLOAD_BUDGET, &die);
+                        if (still_loading != num_loading) {
+                                redraw = 1;
                         }
+                        num_loading = still_loading;
+                }
+                profile_end(PROFILE_ASSETS, start);
 
-                        /* Draw the description of the selected option. */
-                        draw_text(&_font, 100, WINDOW_HEIGHT - (5 + ((_font.height + 1) * 2)), current_menu->descriptions[selection]);
+                /* Take the newest state of the game, and the changes made
+                 * to the world on the way to it. */
+                view = take_snapshot(&is_new);
+                if (is_new) {
+                        profile_record(PROFILE_LOGIC,
+                                       PROFILE_THREAD_SIMULATION,
+                                       view->logic_start,
+                                       view->logic_end);
+                }
+                apply_tile_edits(&_world_view, &_tile_edits);
+                if (view->quit) {
+                        break;
+                }
+                animating = _show_profile || view->moving;
 
+                /* Place the cursor and the entities between where they
+                 * were at the last two ticks. */
+                now = SDL_GetPerformanceCounter();
+                alpha = now > view->time
+                        ? (GLfloat)(now - view->time) / (GLfloat)tick_length
+                        : 0.0f;
+                if (alpha > 1.0f) {
+                        alpha = 1.0f;
+                }
+                row = view->previous_cursor_row
+                      + (view->cursor_row - view->previous_cursor_row) * alpha;
 
-                        /* Draw the cursor. */
-                        {
-                                int x = 0;
-                                int y = WINDOW_HEIGHT - (5 - ((_cursor_sprite.height - _font.height) / 2) + ((_font.height + 1) * (2 + selection)));
-                                glBindTexture(GL_TEXTURE_2D, _cursor_sprite.texture);
-                                glBegin(GL_POLYGON);
-                                        glTexCoord2i(0, 0); glVertex2d(x, y);
-                                        glTexCoord2i(0, 1); glVertex2d(x, y - _cursor_sprite.height);
-                                        glTexCoord2i(1, 1); glVertex2d(x + _cursor_sprite.width, y - _cursor_sprite.height);
-                                        glTexCoord2i(1, 0); glVertex2d(x + _cursor_sprite.width, y);
-                                glEnd();
+                /* Only draw when something on the screen has changed, and
+                 * no sooner than the frame rate cap allows. */
+                if (view->menu != drawn_menu
+                    || view->selection != drawn_selection
+                    || (int)view->mode != drawn_game_mode
+                    || row != drawn_cursor_row
+                    || view->camera_x != drawn_camera_x
+                    || view->camera_y != drawn_camera_y
+                    || _world_view.edits != drawn_edits
+                    || animating) {
+                        redraw = 1;
+                }
+                if (!redraw && !continuous) {
+                        if (present_again) {
+                                present_scene();
+                                SDL_GL_SwapWindow(_window);
+                                present_again = 0;
                         }
+                        continue;
+                }
+                if (now < next_frame_time) {
+                        continue;
+                }
+                next_frame_time += frame_length;
+                if (next_frame_time < now) {
+                        next_frame_time = now;
+                }
+
+                /* Clear the screen. */
+                begin_scene();
+
+                /* Draw the menu, or the world in view. */
+                if (view->mode == GAME_MODE_MENU) {
+                        draw_menu(view->menu, view->selection, row);
+                } else {
+                        draw_tilemap(&_world_view, view->camera_x, view->camera_y);
+                        draw_entities(&view->entities, view->camera_x, view->camera_y, alpha);
+                }
 
-                        glDisable(GL_TEXTURE_2D);
+                /* Draw the profiler overlay on top. */
+                if (_show_profile) {
+                        start = profile_begin();
+                        draw_profile_overlay();
+                        profile_end(PROFILE_OVERLAY, start);
                 }
 
+                /* Draw everything queued up this frame. */
+                start = profile_begin();
+                flush_render_queue();
+                profile_end(PROFILE_RENDER, start);
+
+                /* Scale the frame up to the window. */
+                start = profile_begin();
+                present_scene();
+                profile_end(PROFILE_PRESENT, start);
+
+                start = profile_begin();
                 glFlush();
+                profile_end(PROFILE_FLUSH, start);
 
+                start = profile_begin();
                 SDL_GL_SwapWindow(_window);
+                profile_end(PROFILE_SWAP, start);
 
-                /* Delay until the next frame. */
-                SDL_Delay(40);
+                profile_end(PROFILE_FRAME, frame_start);
+                profile_next_frame();
+
+                _frames_drawn++;
+                finish_frame_allocations();
+                drawn_menu = view->menu;
+                drawn_selection = view->selection;
+                drawn_game_mode = (int)view->mode;
+                drawn_cursor_row = row;
+                drawn_camera_x = view->camera_x;
+                drawn_camera_y = view->camera_y;
+                drawn_edits = _world_view.edits;
+                redraw = 0;
+                present_again = 0;
         }
 
-        /* The program never reaches here. */
+        /* Stop the simulation before the game it runs goes away. */
+        stop_simulation();
+
         return 0;
 }
@@ -0,0 +1,60 @@
+/* pack.h - the layout of lambhorn asset packs
+ * Copyright (c) 2020 Tofu Taco Co-op
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ * .
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ * .
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+#ifndef PACK_H
+#define PACK_H
+
+/* A pack is a header, then a table of entries, then the pixels of each
+ * entry.  The pixels are already in the layout that glTexImage2D takes,
+ * so the game maps the pack into memory and uploads straight from it.
+ * Numbers are in the byte order of the machine that baked the pack. */
+
+/* The magic bytes at the start of every pack */
+#define PACK_MAGIC "LAMBPAK"
+/* The version of the pack layout */
+#define PACK_VERSION 1
+/* The size of an entry name, including the terminating zero */
+#define PACK_NAME_SIZE 32
+/* The alignment of the pixels of each entry */
+#define PACK_ALIGNMENT 64
+
+/* The formats of entry pixels */
+enum {
+        PACK_FORMAT_RGB8 = 1            /* tightly packed RGB, top row first */
+};
+
+/* The header at the start of a pack */
+struct pack_header {
+        char magic[8];
+        Uint32 version;
+        Uint32 num_entries;
+};
+
+/* An entry in the table after the header */
+struct pack_entry {
+        char name[PACK_NAME_SIZE];
+        Uint32 format;
+        Uint32 width;
+        Uint32 height;
+        Uint32 offset;                  /* from the start of the pack */
+        Uint32 size;                    /* of the pixels in bytes */
+        Uint32 reserved[3];
+};
+
+#endif
@@ -0,0 +1,102 @@
+/* save.h - the layout of lambhorn saved games
+ * Copyright (c) 2020 Tofu Taco Co-op
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ * .
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ * .
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+#ifndef SAVE_H
+#define SAVE_H
+
+/* A save is a header, then a table of sections, then the data of each
+ * section.  Each section has two copies, each with room to grow, so that
+ * a section that changes is written over its spare copy without touching
+ * the rest of the file, and the table is then written again to point at
+ * it.  A save cut short still has the old copy to load.  Section data is
+ * laid out the way the game keeps it, so the game maps the save into
+ * memory and copies each part straight out of it.  Numbers are in the
+ * byte order of the machine that saved the game. */
+
+/* The magic bytes at the start of every save */
+#define SAVE_MAGIC "LAMBSAV"
+/* The version of the save layout */
+#define SAVE_VERSION 1
+/* The alignment of the data of each section */
+#define SAVE_ALIGNMENT 64
+
+/* The kinds of sections */
+enum {
+        SAVE_SECTION_CHARACTER = 1,     /* a save_character */
+        SAVE_SECTION_GAME,              /* a save_game */
+        SAVE_SECTION_WORLD,             /* a save_world, then the tiles of
+                                         * each chunk, row by row */
+        SAVE_SECTION_ENTITIES           /* a save_entities, then each
+                                         * component of every entity, then
+                                         * the index and generation of
+                                         * every slot handed out so far,
+                                         * then the free slots among
+                                         * them */
+};
+
+/* The header at the start of a save */
+struct save_header {
+        char magic[8];
+        Uint32 version;
+        Uint32 num_sections;
+};
+
+/* A section in the table after the header */
+struct save_section {
+        Uint32 kind;
+        Uint32 offset;                  /* from the start of the save */
+        Uint32 size;                    /* of the data in bytes */
+        Uint32 capacity;                /* of the room for the data */
+        Uint32 checksum;                /* FNV-1a of the data */
+        Uint32 spare;                   /* the offset of the other copy,
+                                         * which is written next */
+        Uint32 reserved[2];
+};
+
+/* The character made in the menus */
+struct save_character {
+        Uint32 heritage;
+        Uint32 tradition;
+};
+
+/* Where the game is up to */
+struct save_game {
+        Uint32 tick;
+        Sint32 camera_x;
+        Sint32 camera_y;
+        Uint32 player;                  /* the handle of the player */
+};
+
+/* The size of the world */
+struct save_world {
+        Uint32 width;                   /* in tiles */
+        Uint32 height;
+        Uint32 chunk_size;              /* the width and height of chunks */
+        Uint32 reserved;
+};
+
+/* The number of entities */
+struct save_entities {
+        Uint32 count;
+        Uint32 capacity;                /* the number of slots written */
+        Uint32 num_free_slots;
+        Uint32 reserved;
+};
+
+#endif